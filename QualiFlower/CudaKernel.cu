@@ -1,158 +1,124 @@
-__device__ void rgb2hslcuda(double r, double g, double b, double *h, double *s, double *l)
+#include "hslqualifier.h"
+
+#include <stddef.h>
+
+#include <vector>
+
+using namespace qualiflower;
+
+// The white point reduction runs a fixed grid, so each block's histogram gets plenty of pixels
+#define kWhitePointBlocks 64
+#define kWhitePointThreads 256
+
+__global__ void WhitePointKernel(int p_Count, const float* p_Input, unsigned int* p_Max, unsigned int* p_Bins)
 {
-  // Copied from the CPU version, dunno if it's optimal for GPU
-  // rgb are 0->1, return hsl as 0->100
-  double min, max, delta;
-
-  min = r < g ? r : g;
-  min = min  < b ? min : b;
-
-  max = r > g ? r : g;
-  max = max  > b ? max  : b;
-
-  // I seems these rgb values can be > 1. I'm going to just clamp them,
-  // but maybe the right thing would be to assume a range of 0->highest_value_in_image,
-  // rather than 1->1? Not sure.
-  *l = max >= 1.0 ? 100.0 : 100.0 * max;
-
-  delta = max - min;
-  if (delta < 0.00001)
-  {
-      *s = 0;
-      *h = 0;
-      return;
-  }
-  if( max > 0.0 ) { // NOTE: if Max is == 0, this divide would cause a crash
-      *s = 100 * (delta / max);
-  } else {
-      *s = 0.0;
-      *h = NAN;
-      return;
-  }
-  if( r >= max ) {                 // > is bogus, just keeps compiler happy
-      *h = (g - b) / delta;        // between yellow & magenta
-  } else if(g >= max) {
-      *h = 2.0 + (b - r) / delta;  // between cyan & yellow
-  } else {
-      *h = 4.0 + (r - g) / delta;  // between magenta & cyan
-  }
-
-//    *h *= 60.0;                              // degrees
-//    if(*h < 0.0 ) *h += 360.0;
-  *h *= 100.0 / 6.0;
-  if (*h < 0.0) *h += 100.0;
-
-  return;
-}
+    // Each block builds its histogram in shared memory, and adds it to the global one at the end.
+    // The values are all non-negative floats, which sort the same as their bits.
+    __shared__ unsigned int bins[kWhitePointBins];
+    __shared__ unsigned int blockMax;
+    if (p_Bins) {
+        for (int i = threadIdx.x; i < kWhitePointBins; i += blockDim.x) bins[i] = 0;
+    }
+    if (threadIdx.x == 0) blockMax = 0;
+    __syncthreads();
+
+    unsigned int max = 0;
+    for (int i = blockIdx.x * blockDim.x + threadIdx.x; i < p_Count; i += gridDim.x * blockDim.x) {
+        const unsigned int bits = __float_as_uint(whitePointValue(p_Input[i * 4 + 0], p_Input[i * 4 + 1], p_Input[i * 4 + 2]));
+        max = bits > max ? bits : max;
+        if (p_Bins) atomicAdd(&bins[bits >> kWhitePointBinShift], 1u);
+    }
+    atomicMax(&blockMax, max);
+    __syncthreads();
 
+    if (p_Bins) {
+        for (int i = threadIdx.x; i < kWhitePointBins; i += blockDim.x) {
+            if (bins[i]) atomicAdd(&p_Bins[i], bins[i]);
+        }
+    }
+    if (threadIdx.x == 0) atomicMax(p_Max, blockMax);
+}
 
+// The pixel maths is all in hslqualifier.h, shared with the CPU path
 __global__ void HSLSelectKernel(
-    int p_Width, int p_Height,
-    bool _hueEnabled, float _hue, float _hueWidth, float _hueSoftness,
-    bool _saturationEnabled, float _saturationLow, float _saturationHigh, float _saturationLowSoftness, float _saturationHighSoftness,
-    bool _luminanceEnabled, float _luminanceLow, float _luminanceHigh, float _luminanceLowSoftness, float _luminanceHighSoftness,
-    const float* p_Input, float* p_Output)
+    int p_Width, int p_Height, QualifierParams p_Params, CorrectionParams p_Correction,
+    const float* p_Input, const float* p_Mask, int p_MaskX1, int p_MaskY1, int p_MaskX2, int p_MaskY2,
+    int p_MaskRowBytes, int p_MaskComponents, float* p_Output)
 {
-    // rgb are 0->1, return hsl as 0->100
-    // Copied from the CPU version, dunno if it's optimal for GPU
     const int x = blockIdx.x * blockDim.x + threadIdx.x;
     const int y = blockIdx.y * blockDim.y + threadIdx.y;
-    float r, g, b;
-    double h, s, l;
-    double minHue, maxHue, overflowed_h, underflowed_h;
-    double hue_multiplier, sat_multiplier, lum_multiplier;
-    double hue_lower_softness_threshold, hue_upper_softness_threshold;
-    minHue = _hue - .5 * _hueWidth;
-    maxHue = _hue + .5 * _hueWidth;
-    hue_lower_softness_threshold = minHue - _hueSoftness;
-    hue_upper_softness_threshold = maxHue + _hueSoftness;
-
-   if ((x < p_Width) && (y < p_Height))
-   {
+
+    if ((x < p_Width) && (y < p_Height))
+    {
         const int index = ((y * p_Width) + x) * 4;
-        r = p_Input[index + 0];
-        g = p_Input[index + 1];
-        b = p_Input[index + 2];
-        rgb2hslcuda(
-            r, g, b,
-            &h, &s, &l
-        );
-
-
-        if (_hueEnabled) {
-            overflowed_h = h - 100.0;  // "wrapped around" hue, for testing against negative softness window
-            underflowed_h = h + 100.0; // "wrapped around" hue, for testing against overflowed softness window
-            if (h >= minHue && h <= maxHue) {
-                hue_multiplier = 1.0;
-            } else if (overflowed_h >= minHue && overflowed_h <= maxHue) {
-                hue_multiplier = 1.0;
-            } else if (underflowed_h >= minHue && underflowed_h <= maxHue) {
-                hue_multiplier = 1.0;
-            } else if (h > hue_lower_softness_threshold && h < minHue) {
-                hue_multiplier = (h - hue_lower_softness_threshold) / _hueSoftness;
-            } else if (overflowed_h > hue_lower_softness_threshold && overflowed_h < minHue) {
-                hue_multiplier = (overflowed_h - hue_lower_softness_threshold) / _hueSoftness;
-            } else if (h > maxHue && h <= hue_upper_softness_threshold) {
-                hue_multiplier = (hue_upper_softness_threshold - h) / _hueSoftness;
-            } else if (underflowed_h > maxHue && underflowed_h <= hue_upper_softness_threshold) {
-                hue_multiplier = (hue_upper_softness_threshold - underflowed_h) / _hueSoftness;
-            } else {
-                hue_multiplier = 0.0;
+        float r = p_Input[index + 0];
+        float g = p_Input[index + 1];
+        float b = p_Input[index + 2];
+        float h, s, l;
+        rgb2hsl(r, g, b, &h, &s, &l, p_Params.luminanceScale);
+
+        // The mask can have different bounds to the source. Outside them it's 0, like maskValue() on the CPU
+        float mask_value = 1.0f;
+        if (p_Mask) {
+            mask_value = 0.0f;
+            if (x >= p_MaskX1 && x < p_MaskX2 && y >= p_MaskY1 && y < p_MaskY2) {
+                const float* maskRow = reinterpret_cast<const float*>(
+                    reinterpret_cast<const char*>(p_Mask) + static_cast<ptrdiff_t>(y - p_MaskY1) * p_MaskRowBytes);
+                mask_value = maskRow[(x - p_MaskX1) * p_MaskComponents + p_MaskComponents - 1];
             }
-        } else hue_multiplier = 1.0;
-        //if (cc<1) printf("%f %f %f min=%f max=%f a=%f\n", h, s, v, minHue, maxHue, a);
-        //if (cc<1) printf("%f %f %f min=%f max=%f\n", h, s, l, luminance_low, luminance_high);
-
-        if (_saturationEnabled) {
-            if (s >= _saturationLow && s <= _saturationHigh) {
-                sat_multiplier = 1.0;
-            } else if (s < _saturationLow && s > _saturationLow - _saturationLowSoftness) {
-                sat_multiplier = (s - (_saturationLow - _saturationLowSoftness)) / _saturationLowSoftness;
-            } else if (s > _saturationHigh && s < _saturationHigh + _saturationHighSoftness){
-                sat_multiplier = 1.0 - (s - _saturationHigh) / _saturationHighSoftness;
-            } else {
-                sat_multiplier = 0.0;
-            }
-        } else sat_multiplier = 1.0;
-
-        if (_luminanceEnabled) {
-            if (l >= _luminanceLow && l <= _luminanceHigh) {
-                lum_multiplier = 1.0;
-            } else if (l < _luminanceLow && l > _luminanceLow - _luminanceLowSoftness) {
-                lum_multiplier = (l - (_luminanceLow - _luminanceLowSoftness)) / _luminanceLowSoftness;
-            } else if (s > _luminanceHigh && l < _luminanceHigh + _luminanceHighSoftness){
-                lum_multiplier = 1.0 - (l - _luminanceHigh) / _luminanceHighSoftness;
-            } else {
-                lum_multiplier = 0.0;
-            }
-        } else lum_multiplier = 1.0;
-        //if (cc<1) printf("lum multiplier=%f\n", lum_multiplier);
-
+        }
+        const float matte = hslMatte(p_Params, h, s, l) * mask_value;
+        if (p_Correction.enabled && matte > 0.0f) {
+            correctColour(p_Correction, h, matte, &r, &g, &b);
+        }
 
         p_Output[index + 0] = r;
         p_Output[index + 1] = g;
         p_Output[index + 2] = b;
-        p_Output[index + 3] = hue_multiplier * sat_multiplier * lum_multiplier;
+        p_Output[index + 3] = matte;
     }
 }
 
 void RunCudaKernel(
     void* p_Stream, int p_Width, int p_Height,
-    bool hueEnabled, float hue, float hueWidth, float hueSoftness,
-    bool saturationEnabled, float saturationLow, float saturationHigh, float saturationLowSoftness, float saturationHighSoftness,
-    bool luminanceEnabled, float luminanceLow, float luminanceHigh, float luminanceLowSoftness, float luminanceHighSoftness,
-    const float* p_Input, float* p_Output)
+    const QualifierParams& p_Params, const CorrectionParams& p_Correction,
+    const float* p_Input, const float* p_Mask, int p_MaskX1, int p_MaskY1, int p_MaskX2, int p_MaskY2,
+    int p_MaskRowBytes, int p_MaskComponents, float* p_Output)
 {
     dim3 threads(128, 1, 1);
     dim3 blocks(((p_Width + threads.x - 1) / threads.x), p_Height, 1);
     cudaStream_t stream = static_cast<cudaStream_t>(p_Stream);
 
     HSLSelectKernel<<<blocks, threads, 0, stream>>>(
-        p_Width, p_Height,
-        hueEnabled, hue, hueWidth, hueSoftness,
-        saturationEnabled, saturationLow, saturationHigh, saturationLowSoftness, saturationHighSoftness,
-        luminanceEnabled, luminanceLow, luminanceHigh, luminanceLowSoftness, luminanceHighSoftness,
-        p_Input, p_Output
+        p_Width, p_Height, p_Params, p_Correction,
+        p_Input, p_Mask, p_MaskX1, p_MaskY1, p_MaskX2, p_MaskY2,
+        p_MaskRowBytes, p_MaskComponents, p_Output
     );
 }
 
+float RunCudaWhitePoint(void* p_Stream, int p_Width, int p_Height, const float* p_Input, double p_Percentile)
+{
+    cudaStream_t stream = static_cast<cudaStream_t>(p_Stream);
+    const bool histogram = p_Percentile < 100.0;
+
+    // The max goes in the first word, and the histogram after it. It's allocated and freed in
+    // stream order, as cudaFree() would wait for the whole device
+    const size_t words = 1 + (histogram ? kWhitePointBins : 0);
+    unsigned int* result = 0;
+    if (cudaMallocAsync(&result, words * sizeof(unsigned int), stream) != cudaSuccess) return 0.0f;
+    cudaMemsetAsync(result, 0, words * sizeof(unsigned int), stream);
+
+    WhitePointKernel<<<kWhitePointBlocks, kWhitePointThreads, 0, stream>>>(
+        p_Width * p_Height, p_Input, result, histogram ? result + 1 : 0
+    );
+
+    // The matte kernel needs the answer, so this one waits
+    std::vector<uint32_t> host(words);
+    cudaMemcpyAsync(host.data(), result, words * sizeof(unsigned int), cudaMemcpyDeviceToHost, stream);
+    cudaFreeAsync(result, stream);
+    cudaStreamSynchronize(stream);
+
+    float max;
+    memcpy(&max, &host[0], sizeof(max));
+    return histogram ? whitePointFromHistogram(&host[1], max, p_Percentile) : max;
+}
@@ -0,0 +1,364 @@
+#pragma once
+
+// The pixel maths of the qualifier. This doesn't depend on OFX, so it can be
+// benchmarked on its own, and it's the single source of it: the CPU paths in
+// libqualiflower and the CUDA kernels both call the functions marked
+// QUALIFLOWER_HOST_DEVICE. Those stick to float maths that nvcc can compile
+// for the device. It's part of libqualiflower's public API, so everything
+// is in its namespace.
+
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+// nvcc doesn't need the SSE2 paths, and its device pass can't always cope with the intrinsics headers
+#if defined(__SSE2__) && !defined(__CUDACC__)
+#define QUALIFLOWER_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef __CUDACC__
+#define QUALIFLOWER_HOST_DEVICE __host__ __device__
+#else
+#define QUALIFLOWER_HOST_DEVICE
+#endif
+
+namespace qualiflower {
+
+/** @brief A snapshot of the selection params at one time */
+struct QualifierParams
+{
+    bool hueEnabled;
+    float hue, hueWidth, hueSoftness;
+    bool saturationEnabled;
+    float saturationLow, saturationHigh, saturationLowSoftness, saturationHighSoftness;
+    bool luminanceEnabled;
+    float luminanceLow, luminanceHigh, luminanceLowSoftness, luminanceHighSoftness;
+    // max(r, g, b) is multiplied by this before it's clamped to 1 as luminance. 1 / the frame's
+    // white point for HDR material, so everything above 1 doesn't end up at 100
+    float luminanceScale;
+
+    bool operator==(const QualifierParams& p_Other) const;
+};
+
+inline bool QualifierParams::operator==(const QualifierParams& p_Other) const
+{
+    return hueEnabled == p_Other.hueEnabled
+        && hue == p_Other.hue
+        && hueWidth == p_Other.hueWidth
+        && hueSoftness == p_Other.hueSoftness
+        && saturationEnabled == p_Other.saturationEnabled
+        && saturationLow == p_Other.saturationLow
+        && saturationHigh == p_Other.saturationHigh
+        && saturationLowSoftness == p_Other.saturationLowSoftness
+        && saturationHighSoftness == p_Other.saturationHighSoftness
+        && luminanceEnabled == p_Other.luminanceEnabled
+        && luminanceLow == p_Other.luminanceLow
+        && luminanceHigh == p_Other.luminanceHigh
+        && luminanceLowSoftness == p_Other.luminanceLowSoftness
+        && luminanceHighSoftness == p_Other.luminanceHighSoftness
+        && luminanceScale == p_Other.luminanceScale;
+}
+
+QUALIFLOWER_HOST_DEVICE inline void rgb2hsl(float r, float g, float b, float *h, float *s, float *l, float p_LuminanceScale = 1.0f)
+{
+    // rgb are 0->1, return hsl as 0->100
+    float min, max, delta;
+
+    min = r < g ? r : g;
+    min = min  < b ? min : b;
+
+    max = r > g ? r : g;
+    max = max  > b ? max  : b;
+
+    // These rgb values can be > 1. Anything that still is after scaling gets clamped, so
+    // HDR material wants scaling by 1 / its white point, from whitePointFromHistogram()
+    const float lum = max * p_LuminanceScale;
+    *l = lum >= 1.0f ? 100.0f : 100.0f * lum;
+
+    delta = max - min;
+    if (delta < 0.00001f)
+    {
+        *s = 0;
+        *h = 0;
+        return;
+    }
+    if( max > 0.0f ) { // NOTE: if Max is == 0, this divide would cause a crash
+        *s = 100 * (delta / max);
+    } else {
+        *s = 0.0f;
+        *h = NAN;
+        return;
+    }
+    if( r >= max ) {                  // > is bogus, just keeps compiler happy
+        *h = (g - b) / delta;         // between yellow & magenta
+    } else if(g >= max) {
+        *h = 2.0f + (b - r) / delta;  // between cyan & yellow
+    } else {
+        *h = 4.0f + (r - g) / delta;  // between magenta & cyan
+    }
+
+//    *h *= 60.0;                              // degrees
+//    if(*h < 0.0 ) *h += 360.0;
+    *h *= 100.0f / 6.0f;
+    if (*h < 0.0f) *h += 100.0f;
+
+    return;
+}
+
+/* The matte value (0->1) of a pixel, from its hsl (0->100) */
+QUALIFLOWER_HOST_DEVICE inline float hslMatte(const QualifierParams& p_Params, float h, float s, float l)
+{
+    float minHue, maxHue, overflowed_h, underflowed_h;
+    minHue = p_Params.hue - .5f * p_Params.hueWidth;
+    maxHue = p_Params.hue + .5f * p_Params.hueWidth;
+
+    float hue_multiplier, sat_multiplier, lum_multiplier;
+    float hue_lower_softness_threshold, hue_upper_softness_threshold;
+    hue_lower_softness_threshold = minHue - p_Params.hueSoftness;
+    hue_upper_softness_threshold = maxHue + p_Params.hueSoftness;
+
+    if (p_Params.hueEnabled) {
+        overflowed_h = h - 100.0f;  // "wrapped around" hue, for testing against negative softness window
+        underflowed_h = h + 100.0f; // "wrapped around" hue, for testing against overflowed softness window
+        if (h >= minHue && h <= maxHue) {
+            hue_multiplier = 1.0f;
+        } else if (overflowed_h >= minHue && overflowed_h <= maxHue) {
+            hue_multiplier = 1.0f;
+        } else if (underflowed_h >= minHue && underflowed_h <= maxHue) {
+            hue_multiplier = 1.0f;
+        } else if (h > hue_lower_softness_threshold && h < minHue) {
+            hue_multiplier = (h - hue_lower_softness_threshold) / p_Params.hueSoftness;
+        } else if (overflowed_h > hue_lower_softness_threshold && overflowed_h < minHue) {
+            hue_multiplier = (overflowed_h - hue_lower_softness_threshold) / p_Params.hueSoftness;
+        } else if (h > maxHue && h <= hue_upper_softness_threshold) {
+            hue_multiplier = (hue_upper_softness_threshold - h) / p_Params.hueSoftness;
+        } else if (underflowed_h > maxHue && underflowed_h <= hue_upper_softness_threshold) {
+            hue_multiplier = (hue_upper_softness_threshold - underflowed_h) / p_Params.hueSoftness;
+        } else {
+            hue_multiplier = 0.0f;
+        }
+    } else hue_multiplier = 1.0f;
+    //if (cc<1) printf("%f %f %f min=%f max=%f a=%f\n", h, s, v, minHue, maxHue, a);
+    //if (cc<1) printf("%f %f %f min=%f max=%f\n", h, s, l, luminance_low, luminance_high);
+
+    if (p_Params.saturationEnabled) {
+        if (s >= p_Params.saturationLow && s <= p_Params.saturationHigh) {
+            sat_multiplier = 1.0f;
+        } else if (s < p_Params.saturationLow && s > p_Params.saturationLow - p_Params.saturationLowSoftness) {
+            sat_multiplier = (s - (p_Params.saturationLow - p_Params.saturationLowSoftness)) / p_Params.saturationLowSoftness;
+        } else if (s > p_Params.saturationHigh && s < p_Params.saturationHigh + p_Params.saturationHighSoftness){
+            sat_multiplier = 1.0f - (s - p_Params.saturationHigh) / p_Params.saturationHighSoftness;
+        } else {
+            sat_multiplier = 0.0f;
+        }
+    } else sat_multiplier = 1.0f;
+
+    if (p_Params.luminanceEnabled) {
+        if (l >= p_Params.luminanceLow && l <= p_Params.luminanceHigh) {
+            lum_multiplier = 1.0f;
+        } else if (l < p_Params.luminanceLow && l > p_Params.luminanceLow - p_Params.luminanceLowSoftness) {
+            lum_multiplier = (l - (p_Params.luminanceLow - p_Params.luminanceLowSoftness)) / p_Params.luminanceLowSoftness;
+        } else if (l > p_Params.luminanceHigh && l < p_Params.luminanceHigh + p_Params.luminanceHighSoftness){
+            lum_multiplier = 1.0f - (l - p_Params.luminanceHigh) / p_Params.luminanceHighSoftness;
+        } else {
+            lum_multiplier = 0.0f;
+        }
+    } else lum_multiplier = 1.0f;
+    //if (cc<1) printf("lum multiplier=%f\n", lum_multiplier);
+
+    return hue_multiplier * sat_multiplier * lum_multiplier;
+}
+
+/* The matte value (0->1) of an rgb pixel */
+QUALIFLOWER_HOST_DEVICE inline float qualify(const QualifierParams& p_Params, float r, float g, float b)
+{
+    float h, s, l;
+    rgb2hsl(r, g, b, &h, &s, &l, p_Params.luminanceScale);
+    return hslMatte(p_Params, h, s, l);
+}
+
+// A frame's white point comes from a histogram of max(r, g, b). Non-negative floats sort the
+// same as their bits, so the exponent and top 4 bits of mantissa make log spaced bins, each
+// 1/16 of an octave wide.
+static const int kWhitePointBinShift = 19;
+// Enough bins for every finite non-negative float
+static const int kWhitePointBins = 255 << (23 - kWhitePointBinShift);
+
+/* max(r, g, b) of a pixel, for the white point. NaN, infinite and negative values are black */
+QUALIFLOWER_HOST_DEVICE inline float whitePointValue(float r, float g, float b)
+{
+    // Written so NaNs fall through the same way they do with _mm_max_ps
+    float v = r > g ? r : g;
+    v = v > b ? v : b;
+    v = v <= FLT_MAX ? v : 0.0f;
+    return v > 0.0f ? v : 0.0f;
+}
+
+inline uint32_t whitePointBin(float p_Value)
+{
+    uint32_t bits;
+    memcpy(&bits, &p_Value, sizeof(bits));
+    return bits >> kWhitePointBinShift;
+}
+
+/* Raise *p_Max to the brightest whitePointValue() of count rgba pixels, and add them to p_Bins
+   (kWhitePointBins long) unless it's null. Scalar version */
+inline void whitePointRowScalar(const float* p_Pix, int p_Count, float* p_Max, uint32_t* p_Bins)
+{
+    float max = *p_Max;
+    for (int i = 0; i < p_Count; i++) {
+        const float v = whitePointValue(p_Pix[0], p_Pix[1], p_Pix[2]);
+        max = v > max ? v : max;
+        if (p_Bins) p_Bins[whitePointBin(v)]++;
+        p_Pix += 4;
+    }
+    *p_Max = max;
+}
+
+#ifdef QUALIFLOWER_SSE2
+/* whitePointRowScalar(), four pixels at a time */
+inline void whitePointRowSSE2(const float* p_Pix, int p_Count, float* p_Max, uint32_t* p_Bins)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 largest = _mm_set1_ps(FLT_MAX);
+    __m128 max = _mm_set1_ps(*p_Max);
+    int i = 0;
+    for (; i + 4 <= p_Count; i += 4) {
+        __m128 r = _mm_loadu_ps(p_Pix + 4 * i);
+        __m128 g = _mm_loadu_ps(p_Pix + 4 * i + 4);
+        __m128 b = _mm_loadu_ps(p_Pix + 4 * i + 8);
+        __m128 a = _mm_loadu_ps(p_Pix + 4 * i + 12);
+        _MM_TRANSPOSE4_PS(r, g, b, a);
+        __m128 v = _mm_max_ps(_mm_max_ps(r, g), b);
+        v = _mm_and_ps(v, _mm_cmple_ps(v, largest));
+        v = _mm_max_ps(v, zero);
+        max = _mm_max_ps(v, max);
+        if (p_Bins) {
+            // There's no scatter, so the histogram itself is four scalar increments
+            uint32_t bins[4];
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(bins), _mm_srli_epi32(_mm_castps_si128(v), kWhitePointBinShift));
+            p_Bins[bins[0]]++;
+            p_Bins[bins[1]]++;
+            p_Bins[bins[2]]++;
+            p_Bins[bins[3]]++;
+        }
+    }
+    max = _mm_max_ps(max, _mm_shuffle_ps(max, max, _MM_SHUFFLE(1, 0, 3, 2)));
+    max = _mm_max_ps(max, _mm_shuffle_ps(max, max, _MM_SHUFFLE(2, 3, 0, 1)));
+    _mm_store_ss(p_Max, max);
+    whitePointRowScalar(p_Pix + 4 * i, p_Count - i, p_Max, p_Bins);
+}
+#endif
+
+inline void whitePointRow(const float* p_Pix, int p_Count, float* p_Max, uint32_t* p_Bins)
+{
+#ifdef QUALIFLOWER_SSE2
+    whitePointRowSSE2(p_Pix, p_Count, p_Max, p_Bins);
+#else
+    whitePointRowScalar(p_Pix, p_Count, p_Max, p_Bins);
+#endif
+}
+
+/* The value p_Percentile percent of the pixels in a white point histogram are at or below, to
+   within a bin. p_Max is the brightest of them, which is the answer at 100 */
+inline float whitePointFromHistogram(const uint32_t* p_Bins, float p_Max, double p_Percentile)
+{
+    if (p_Percentile >= 100.0) return p_Max;
+
+    uint64_t count = 0;
+    for (int i = 0; i < kWhitePointBins; i++) count += p_Bins[i];
+    if (!count) return p_Max;
+
+    uint64_t target = static_cast<uint64_t>(ceil(count * p_Percentile / 100.0));
+    target = target ? target : 1;
+    uint64_t sum = 0;
+    for (int i = 0; i < kWhitePointBins; i++) {
+        sum += p_Bins[i];
+        if (sum >= target) {
+            // The top of the bin
+            const uint32_t bits = static_cast<uint32_t>(i + 1) << kWhitePointBinShift;
+            float top;
+            memcpy(&top, &bits, sizeof(top));
+            return top < p_Max ? top : p_Max;
+        }
+    }
+    return p_Max;
+}
+
+/* What to set QualifierParams::luminanceScale to for a white point */
+inline float luminanceScaleFor(float p_WhitePoint)
+{
+    return p_WhitePoint > 0.0f ? 1.0f / p_WhitePoint : 1.0f;
+}
+
+/** @brief A snapshot of the colour correction params, for correcting inside the selection */
+struct CorrectionParams
+{
+    bool enabled;
+    float hueShift;         // in the same 0->100 units as hue
+    float saturationGain;
+    float lift, gamma, gain;
+    float despill;          // 0->1
+    int despillChannel;     // the rgb channel closest to the selected hue
+};
+
+/* Which of r, g or b is closest to a hue (0->100) */
+inline int nearestChannel(float p_Hue)
+{
+    int channel = static_cast<int>(floor(p_Hue * 3.0 / 100.0 + 0.5)) % 3;
+    return channel < 0 ? channel + 3 : channel;
+}
+
+/* Correct an rgb pixel, with hue h (0->100) from rgb2hsl, blending by p_Weight (0->1). Despill is
+   applied first, and the rest works from the despilled colour */
+QUALIFLOWER_HOST_DEVICE inline void correctColour(const CorrectionParams& p_Correction, float h, float p_Weight, float* r, float* g, float* b)
+{
+    float rgb[3] = { *r, *g, *b };
+
+    // Despill, by limiting the channel closest to the selected hue to the average of the other two
+    if (p_Correction.despill > 0.0f) {
+        const int c = p_Correction.despillChannel;
+        const float limit = 0.5f * (rgb[(c + 1) % 3] + rgb[(c + 2) % 3]);
+        if (rgb[c] > limit) {
+            rgb[c] -= p_Correction.despill * (rgb[c] - limit);
+            // Despill moves the hue, and the hue shift below has to start from where it's moved to
+            float s, l;
+            rgb2hsl(rgb[0], rgb[1], rgb[2], &h, &s, &l);
+        }
+    }
+
+    // Hue shift and saturation gain, around the max channel like hsv. Greys and the
+    // NaN hue of negative blacks are left alone.
+    float max = rgb[0] > rgb[1] ? rgb[0] : rgb[1];
+    max = max > rgb[2] ? max : rgb[2];
+    float min = rgb[0] < rgb[1] ? rgb[0] : rgb[1];
+    min = min < rgb[2] ? min : rgb[2];
+    if ((p_Correction.hueShift != 0.0f || p_Correction.saturationGain != 1.0f) && max - min >= 0.00001f && !isnan(h)) {
+        float chroma = (max - min) * p_Correction.saturationGain;
+        if (max > 0.0f && chroma > max) chroma = max;
+        float hue6 = fmodf(h + p_Correction.hueShift, 100.0f) * 6.0f / 100.0f;
+        if (hue6 < 0.0f) hue6 += 6.0f;
+        // Standard hsv -> rgb, with n = 5, 3, 1 for r, g, b
+        for (int i = 0; i < 3; i++) {
+            float k = fmodf(5.0f - 2.0f * i + hue6, 6.0f);
+            float f = k < 4.0f - k ? k : 4.0f - k;
+            f = f < 1.0f ? f : 1.0f;
+            f = f > 0.0f ? f : 0.0f;
+            rgb[i] = max - chroma * f;
+        }
+    }
+
+    // Lift, gamma and gain
+    for (int i = 0; i < 3; i++) {
+        float x = rgb[i] * p_Correction.gain + p_Correction.lift * (1.0f - rgb[i]);
+        rgb[i] = p_Correction.gamma != 1.0f ? powf(x > 0.0f ? x : 0.0f, 1.0f / p_Correction.gamma) : x;
+    }
+
+    *r += p_Weight * (rgb[0] - *r);
+    *g += p_Weight * (rgb[1] - *g);
+    *b += p_Weight * (rgb[2] - *b);
+}
+
+} // namespace qualiflower
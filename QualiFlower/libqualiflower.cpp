@@ -0,0 +1,536 @@
+#include "libqualiflower.h"
+
+#include <stdint.h>
+
+#include <atomic>
+#include <thread>
+
+namespace qualiflower {
+
+Frame::Frame()
+    : data(0)
+    , rowBytes(0)
+    , format(eFormatNone)
+{
+    bounds.x1 = bounds.y1 = bounds.x2 = bounds.y2 = 0;
+}
+
+Frame::Frame(void* p_Data, int p_Width, int p_Height, ptrdiff_t p_RowBytes, PixelFormat p_Format)
+    : data(p_Data)
+    , rowBytes(p_RowBytes)
+    , format(p_Format)
+{
+    bounds.x1 = 0;
+    bounds.y1 = 0;
+    bounds.x2 = p_Width;
+    bounds.y2 = p_Height;
+}
+
+FrameJob::FrameJob()
+    : matte(0)
+    , neighbourMattes(0)
+    , neighbourMatteCount(0)
+    , occupancy(0)
+    , abort(0)
+    , abortArg(0)
+{
+    // The same defaults as the plugin's params: everything selected at 1, and no correction
+    params.qualifier.hueEnabled = true;
+    params.qualifier.hue = 1.0f;
+    params.qualifier.hueWidth = 1.0f;
+    params.qualifier.hueSoftness = 1.0f;
+    params.qualifier.saturationEnabled = true;
+    params.qualifier.saturationLow = 1.0f;
+    params.qualifier.saturationHigh = 1.0f;
+    params.qualifier.saturationLowSoftness = 1.0f;
+    params.qualifier.saturationHighSoftness = 1.0f;
+    params.qualifier.luminanceEnabled = true;
+    params.qualifier.luminanceLow = 1.0f;
+    params.qualifier.luminanceHigh = 1.0f;
+    params.qualifier.luminanceLowSoftness = 1.0f;
+    params.qualifier.luminanceHighSoftness = 1.0f;
+    params.qualifier.luminanceScale = 1.0f;
+    params.correction.enabled = false;
+    params.correction.hueShift = 0.0f;
+    params.correction.saturationGain = 1.0f;
+    params.correction.lift = 0.0f;
+    params.correction.gamma = 1.0f;
+    params.correction.gain = 1.0f;
+    params.correction.despill = 0.0f;
+    params.correction.despillChannel = nearestChannel(params.qualifier.hue);
+    window.x1 = window.y1 = window.x2 = window.y2 = 0;
+}
+
+ThreadPool::~ThreadPool()
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Pixel formats
+
+template <PixelFormat F> struct Pixel;
+
+template <> struct Pixel<eFormatNone>
+{
+    typedef float T;
+    enum { channels = 0 };
+    static float read(T v) { return v; }
+    static T write(float v) { return v; }
+};
+
+template <> struct Pixel<eFormatRGBAFloat>
+{
+    typedef float T;
+    enum { channels = 4 };
+    static float read(T v) { return v; }
+    static T write(float v) { return v; }
+};
+
+template <> struct Pixel<eFormatRGBFloat>
+{
+    typedef float T;
+    enum { channels = 3 };
+    static float read(T v) { return v; }
+    static T write(float v) { return v; }
+};
+
+template <> struct Pixel<eFormatAlphaFloat>
+{
+    typedef float T;
+    enum { channels = 1 };
+    static float read(T v) { return v; }
+    static T write(float v) { return v; }
+};
+
+template <> struct Pixel<eFormatRGBAByte>
+{
+    typedef uint8_t T;
+    enum { channels = 4 };
+    static float read(T v) { return v * (1.0f / 255.0f); }
+    static T write(float v) { return v <= 0.0f ? 0 : (v >= 1.0f ? 255 : static_cast<T>(v * 255.0f + 0.5f)); }
+};
+
+template <> struct Pixel<eFormatRGBAShort>
+{
+    typedef uint16_t T;
+    enum { channels = 4 };
+    static float read(T v) { return v * (1.0f / 65535.0f); }
+    static T write(float v) { return v <= 0.0f ? 0 : (v >= 1.0f ? 65535 : static_cast<T>(v * 65535.0f + 0.5f)); }
+};
+
+/* The start of row y of a frame, or null if the row isn't in it */
+template <PixelFormat F>
+static inline typename Pixel<F>::T* rowAddress(const Frame& p_Frame, int y)
+{
+    if (!p_Frame.data || y < p_Frame.bounds.y1 || y >= p_Frame.bounds.y2) return 0;
+    return reinterpret_cast<typename Pixel<F>::T*>(static_cast<char*>(p_Frame.data) + (y - p_Frame.bounds.y1) * p_Frame.rowBytes);
+}
+
+/* Alpha of a mask pixel, 0 outside the mask */
+static inline float maskValue(const Frame& p_Mask, int x, int y)
+{
+    if (x < p_Mask.bounds.x1 || x >= p_Mask.bounds.x2 || y < p_Mask.bounds.y1 || y >= p_Mask.bounds.y2) return 0.0f;
+    const int i = x - p_Mask.bounds.x1;
+    switch (p_Mask.format) {
+    case eFormatRGBAFloat:
+        return Pixel<eFormatRGBAFloat>::read(rowAddress<eFormatRGBAFloat>(p_Mask, y)[i * 4 + 3]);
+    case eFormatAlphaFloat:
+        return Pixel<eFormatAlphaFloat>::read(rowAddress<eFormatAlphaFloat>(p_Mask, y)[i]);
+    case eFormatRGBAByte:
+        return Pixel<eFormatRGBAByte>::read(rowAddress<eFormatRGBAByte>(p_Mask, y)[i * 4 + 3]);
+    case eFormatRGBAShort:
+        return Pixel<eFormatRGBAShort>::read(rowAddress<eFormatRGBAShort>(p_Mask, y)[i * 4 + 3]);
+    default:
+        return 0.0f;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Threads
+
+/** @brief What we use when the caller doesn't give us a thread pool */
+class DefaultThreadPool : public ThreadPool
+{
+public:
+    virtual unsigned int threadCount() const
+    {
+        const unsigned int count = std::thread::hardware_concurrency();
+        return count ? count : 1;
+    }
+
+    virtual void run(unsigned int p_Count, TaskFunction p_Function, void* p_Arg)
+    {
+        std::atomic<unsigned int> next(0);
+        const unsigned int threads = p_Count < threadCount() ? p_Count : threadCount();
+        std::vector<std::thread> spawned;
+        for (unsigned int i = 1; i < threads; i++) {
+            spawned.push_back(std::thread(work, &next, p_Count, p_Function, p_Arg));
+        }
+        work(&next, p_Count, p_Function, p_Arg);
+        for (size_t i = 0; i < spawned.size(); i++) {
+            spawned[i].join();
+        }
+    }
+
+private:
+    static void work(std::atomic<unsigned int>* p_Next, unsigned int p_Count, TaskFunction p_Function, void* p_Arg)
+    {
+        for (unsigned int i = (*p_Next)++; i < p_Count; i = (*p_Next)++) {
+            p_Function(i, p_Arg);
+        }
+    }
+};
+
+static void runTasks(ThreadPool* p_Pool, unsigned int p_Count, TaskFunction p_Function, void* p_Arg)
+{
+    if (p_Count == 0) return;
+    if (p_Pool) {
+        p_Pool->run(p_Count, p_Function, p_Arg);
+    } else {
+        DefaultThreadPool pool;
+        pool.run(p_Count, p_Function, p_Arg);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Mask occupancy
+
+struct OccupancyTask
+{
+    const Frame* mask;
+    MaskOccupancy* occupancy;
+};
+
+static void findStripExtent(unsigned int p_Index, void* p_Arg)
+{
+    OccupancyTask* task = static_cast<OccupancyTask*>(p_Arg);
+    const Rect& window = task->occupancy->window;
+    Rect& strip = task->occupancy->strips[p_Index];
+    strip.y1 = window.y1 + static_cast<int>(p_Index) * kMaskStripHeight;
+    strip.y2 = strip.y1 + kMaskStripHeight < window.y2 ? strip.y1 + kMaskStripHeight : window.y2;
+    strip.x1 = window.x2;
+    strip.x2 = window.x1;
+
+    for (int y = strip.y1; y < strip.y2; y++) {
+        for (int x = window.x1; x < window.x2; x++) {
+            if (maskValue(*task->mask, x, y) > 0.0f) {
+                if (x < strip.x1) strip.x1 = x;
+                if (x >= strip.x2) strip.x2 = x + 1;
+            }
+        }
+    }
+}
+
+void computeMaskOccupancy(const Frame& p_Mask, const Rect& p_Window, MaskOccupancy& p_Occupancy, ThreadPool* p_Pool)
+{
+    const int rows = p_Window.y2 - p_Window.y1;
+    p_Occupancy.window = p_Window;
+    p_Occupancy.strips.resize(rows > 0 ? (rows + kMaskStripHeight - 1) / kMaskStripHeight : 0);
+
+    OccupancyTask task;
+    task.mask = &p_Mask;
+    task.occupancy = &p_Occupancy;
+    runTasks(p_Pool, static_cast<unsigned int>(p_Occupancy.strips.size()), findStripExtent, &task);
+
+    Rect& bounds = p_Occupancy.bounds;
+    bounds.x1 = p_Window.x2;
+    bounds.x2 = p_Window.x1;
+    bounds.y1 = p_Window.y1;
+    bounds.y2 = p_Window.y1;
+    bool empty = true;
+    for (size_t i = 0; i < p_Occupancy.strips.size(); i++) {
+        const Rect& strip = p_Occupancy.strips[i];
+        if (strip.x1 >= strip.x2) continue;
+        if (strip.x1 < bounds.x1) bounds.x1 = strip.x1;
+        if (strip.x2 > bounds.x2) bounds.x2 = strip.x2;
+        if (empty) bounds.y1 = strip.y1;
+        bounds.y2 = strip.y2;
+        empty = false;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// White point
+
+template <PixelFormat S>
+static inline void formatWhitePointRow(const typename Pixel<S>::T* p_Row, int p_Count, float* p_Max, uint32_t* p_Bins)
+{
+    float max = *p_Max;
+    for (int i = 0; i < p_Count; i++, p_Row += Pixel<S>::channels) {
+        const float v = whitePointValue(Pixel<S>::read(p_Row[0]), Pixel<S>::read(p_Row[1]), Pixel<S>::read(p_Row[2]));
+        max = v > max ? v : max;
+        if (p_Bins) p_Bins[whitePointBin(v)]++;
+    }
+    *p_Max = max;
+}
+
+// Packed float rgba, which is most of what we see, gets the SIMD version
+template <>
+inline void formatWhitePointRow<eFormatRGBAFloat>(const float* p_Row, int p_Count, float* p_Max, uint32_t* p_Bins)
+{
+    whitePointRow(p_Row, p_Count, p_Max, p_Bins);
+}
+
+struct WhitePointTask
+{
+    const Frame* src;
+    Rect window;
+    int rowsPerTask;
+    // A max for each task, and a histogram too unless we only want the max
+    std::vector<float> max;
+    std::vector<uint32_t> bins;
+};
+
+template <PixelFormat S>
+static void scanWhitePoint(WhitePointTask& p_Task, unsigned int p_Index)
+{
+    const Rect& window = p_Task.window;
+    const int y1 = window.y1 + static_cast<int>(p_Index) * p_Task.rowsPerTask;
+    const int y2 = y1 + p_Task.rowsPerTask < window.y2 ? y1 + p_Task.rowsPerTask : window.y2;
+    float* max = &p_Task.max[p_Index];
+    uint32_t* bins = p_Task.bins.empty() ? 0 : &p_Task.bins[p_Index * kWhitePointBins];
+
+    for (int y = y1; y < y2; y++) {
+        const typename Pixel<S>::T* row = rowAddress<S>(*p_Task.src, y) + (window.x1 - p_Task.src->bounds.x1) * Pixel<S>::channels;
+        formatWhitePointRow<S>(row, window.x2 - window.x1, max, bins);
+    }
+}
+
+static void whitePointTask(unsigned int p_Index, void* p_Arg)
+{
+    WhitePointTask& task = *static_cast<WhitePointTask*>(p_Arg);
+    switch (task.src->format) {
+    case eFormatRGBAFloat: scanWhitePoint<eFormatRGBAFloat>(task, p_Index); break;
+    case eFormatRGBFloat: scanWhitePoint<eFormatRGBFloat>(task, p_Index); break;
+    case eFormatRGBAByte: scanWhitePoint<eFormatRGBAByte>(task, p_Index); break;
+    case eFormatRGBAShort: scanWhitePoint<eFormatRGBAShort>(task, p_Index); break;
+    default: break;
+    }
+}
+
+float whitePoint(const Frame& p_Src, const Rect& p_Window, double p_Percentile, ThreadPool* p_Pool)
+{
+    if (!p_Src.data || p_Src.format == eFormatNone || p_Src.format == eFormatAlphaFloat) return 0.0f;
+
+    // Only the part of the window that's in the source counts
+    WhitePointTask task;
+    task.src = &p_Src;
+    task.window.x1 = p_Window.x1 > p_Src.bounds.x1 ? p_Window.x1 : p_Src.bounds.x1;
+    task.window.y1 = p_Window.y1 > p_Src.bounds.y1 ? p_Window.y1 : p_Src.bounds.y1;
+    task.window.x2 = p_Window.x2 < p_Src.bounds.x2 ? p_Window.x2 : p_Src.bounds.x2;
+    task.window.y2 = p_Window.y2 < p_Src.bounds.y2 ? p_Window.y2 : p_Src.bounds.y2;
+    const int rows = task.window.y2 - task.window.y1;
+    if (rows <= 0 || task.window.x2 <= task.window.x1) return 0.0f;
+
+    // Each task has its own histogram, so rather than lots of small tasks there's a couple per thread
+    const unsigned int threads = p_Pool ? p_Pool->threadCount() : DefaultThreadPool().threadCount();
+    unsigned int taskCount = 2 * threads < static_cast<unsigned int>(rows) ? 2 * threads : rows;
+    task.rowsPerTask = (rows + taskCount - 1) / taskCount;
+    taskCount = (rows + task.rowsPerTask - 1) / task.rowsPerTask;
+    task.max.assign(taskCount, 0.0f);
+    if (p_Percentile < 100.0) task.bins.assign(static_cast<size_t>(taskCount) * kWhitePointBins, 0);
+
+    runTasks(p_Pool, taskCount, whitePointTask, &task);
+
+    std::vector<uint32_t> bins(task.bins.empty() ? 0 : kWhitePointBins, 0);
+    float max = 0.0f;
+    for (unsigned int t = 0; t < taskCount; t++) {
+        max = task.max[t] > max ? task.max[t] : max;
+        for (size_t i = 0; i < bins.size(); i++) bins[i] += task.bins[t * kWhitePointBins + i];
+    }
+    return bins.empty() ? max : whitePointFromHistogram(bins.data(), max, p_Percentile);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Processing
+
+/* The output alpha at window index p_Index, given this frame's matte there */
+static inline float smoothedMatte(const FrameJob& p_Job, float p_Matte, size_t p_Index)
+{
+    if (!p_Job.neighbourMatteCount) return p_Matte;
+
+    float sum = p_Matte;
+    for (int i = 0; i < p_Job.neighbourMatteCount; i++) {
+        sum += p_Job.neighbourMattes[i][p_Index];
+    }
+    return sum / (p_Job.neighbourMatteCount + 1);
+}
+
+/* Process [p_X1, p_X2) of row y. If EVALUATE is false, the mask has ruled these pixels out,
+   so they just get the source rgb with a zero matte and none of the HSL maths */
+template <PixelFormat S, PixelFormat D, bool EVALUATE>
+static inline void processSpan(const FrameJob& p_Job, const typename Pixel<S>::T* p_SrcRow, typename Pixel<D>::T* p_DstRow,
+                               int p_SrcX1, int p_SrcX2, int p_X1, int p_X2, int y)
+{
+    const int windowWidth = p_Job.window.x2 - p_Job.window.x1;
+    size_t index = static_cast<size_t>(y - p_Job.window.y1) * windowWidth + (p_X1 - p_Job.window.x1);
+
+    for (int x = p_X1; x < p_X2; x++, index++) {
+        // pixels outside the source are all zero
+        const bool inSrc = p_SrcRow && x >= p_SrcX1 && x < p_SrcX2;
+        float r = 0.0f, g = 0.0f, b = 0.0f;
+        if (inSrc) {
+            const typename Pixel<S>::T* srcPix = p_SrcRow + (x - p_Job.src.bounds.x1) * Pixel<S>::channels;
+            r = Pixel<S>::read(srcPix[0]);
+            g = Pixel<S>::read(srcPix[1]);
+            b = Pixel<S>::read(srcPix[2]);
+        }
+
+        float matte = 0.0f;
+        if (EVALUATE && inSrc) {
+            const float mask = p_Job.mask.data ? maskValue(p_Job.mask, x, y) : 1.0f;
+            if (mask > 0.0f) {
+                float h, s, l;
+                rgb2hsl(r, g, b, &h, &s, &l, p_Job.params.qualifier.luminanceScale);
+                matte = hslMatte(p_Job.params.qualifier, h, s, l) * mask;
+                // Correct the colour inside the selection while we've got the pixel
+                if (p_Job.params.correction.enabled && matte > 0.0f) {
+                    correctColour(p_Job.params.correction, h, matte, &r, &g, &b);
+                }
+            }
+        }
+        if (p_Job.matte) p_Job.matte[index] = matte;
+
+        if (Pixel<D>::channels != 0) {
+            typename Pixel<D>::T* dstPix = p_DstRow + (x - p_Job.dst.bounds.x1) * Pixel<D>::channels;
+            const float alpha = inSrc ? smoothedMatte(p_Job, matte, index) : 0.0f;
+            if (Pixel<D>::channels >= 3) {
+                dstPix[0] = Pixel<D>::write(r);
+                dstPix[1] = Pixel<D>::write(g);
+                dstPix[2] = Pixel<D>::write(b);
+            }
+            if (Pixel<D>::channels == 4) dstPix[3] = Pixel<D>::write(alpha);
+            if (Pixel<D>::channels == 1) dstPix[0] = Pixel<D>::write(alpha);
+        }
+    }
+}
+
+template <PixelFormat S, PixelFormat D>
+static void processRows(const FrameJob& p_Job, const Rect& p_ProcWindow)
+{
+    const int srcX1 = p_Job.src.bounds.x1;
+    const int srcX2 = p_Job.src.bounds.x2;
+    const MaskOccupancy* occupancy = p_Job.mask.data ? p_Job.occupancy : 0;
+
+    for (int y = p_ProcWindow.y1; y < p_ProcWindow.y2; y++) {
+        if (p_Job.abort && p_Job.abort(p_Job.abortArg)) break;
+
+        const typename Pixel<S>::T* srcRow = rowAddress<S>(p_Job.src, y);
+        typename Pixel<D>::T* dstRow = rowAddress<D>(p_Job.dst, y);
+
+        // Work out which part of this row the mask leaves visible. The matte is zero everywhere
+        // else, so there's no need to do any HSL maths there.
+        int spanX1 = p_ProcWindow.x1;
+        int spanX2 = p_ProcWindow.x2;
+        if (occupancy) {
+            if (y < occupancy->bounds.y1 || y >= occupancy->bounds.y2) {
+                spanX1 = spanX2 = p_ProcWindow.x2;
+            } else {
+                const Rect& strip = occupancy->strips[(y - occupancy->window.y1) / kMaskStripHeight];
+                spanX1 = strip.x1 > p_ProcWindow.x1 ? strip.x1 : p_ProcWindow.x1;
+                spanX2 = strip.x2 < p_ProcWindow.x2 ? strip.x2 : p_ProcWindow.x2;
+                if (spanX2 < spanX1) spanX2 = spanX1;
+            }
+        }
+
+        processSpan<S, D, false>(p_Job, srcRow, dstRow, srcX1, srcX2, p_ProcWindow.x1, spanX1, y);
+        processSpan<S, D, true>(p_Job, srcRow, dstRow, srcX1, srcX2, spanX1, spanX2, y);
+        processSpan<S, D, false>(p_Job, srcRow, dstRow, srcX1, srcX2, spanX2, p_ProcWindow.x2, y);
+    }
+}
+
+template <PixelFormat S>
+static void processRowsToDst(const FrameJob& p_Job, const Rect& p_ProcWindow)
+{
+    switch (p_Job.dst.format) {
+    case eFormatNone: processRows<S, eFormatNone>(p_Job, p_ProcWindow); break;
+    case eFormatRGBAFloat: processRows<S, eFormatRGBAFloat>(p_Job, p_ProcWindow); break;
+    case eFormatRGBFloat: processRows<S, eFormatRGBFloat>(p_Job, p_ProcWindow); break;
+    case eFormatAlphaFloat: processRows<S, eFormatAlphaFloat>(p_Job, p_ProcWindow); break;
+    case eFormatRGBAByte: processRows<S, eFormatRGBAByte>(p_Job, p_ProcWindow); break;
+    case eFormatRGBAShort: processRows<S, eFormatRGBAShort>(p_Job, p_ProcWindow); break;
+    }
+}
+
+void processWindow(const FrameJob& p_Job, const Rect& p_ProcWindow)
+{
+    switch (p_Job.src.format) {
+    case eFormatRGBAFloat: processRowsToDst<eFormatRGBAFloat>(p_Job, p_ProcWindow); break;
+    case eFormatRGBFloat: processRowsToDst<eFormatRGBFloat>(p_Job, p_ProcWindow); break;
+    case eFormatRGBAByte: processRowsToDst<eFormatRGBAByte>(p_Job, p_ProcWindow); break;
+    case eFormatRGBAShort: processRowsToDst<eFormatRGBAShort>(p_Job, p_ProcWindow); break;
+    default: break;
+    }
+}
+
+bool isSupported(const FrameJob& p_Job)
+{
+    if (!p_Job.src.data || p_Job.src.format == eFormatNone || p_Job.src.format == eFormatAlphaFloat) return false;
+    if (p_Job.mask.data && (p_Job.mask.format == eFormatNone || p_Job.mask.format == eFormatRGBFloat)) return false;
+    if (p_Job.dst.format != eFormatNone) {
+        if (!p_Job.dst.data) return false;
+        const Rect& window = p_Job.window;
+        const Rect& bounds = p_Job.dst.bounds;
+        if (window.x1 < bounds.x1 || window.y1 < bounds.y1 || window.x2 > bounds.x2 || window.y2 > bounds.y2) return false;
+    }
+    if (p_Job.neighbourMatteCount && !p_Job.neighbourMattes) return false;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Rows per task. Small enough to share the work out evenly, big enough not to notice the overhead
+static const int kRowsPerTask = 16;
+
+struct BatchTask
+{
+    const FrameJob* jobs;
+    // The first task index of each job, and one past the last
+    std::vector<unsigned int> firstTask;
+};
+
+static void processBatchTask(unsigned int p_Index, void* p_Arg)
+{
+    BatchTask* batch = static_cast<BatchTask*>(p_Arg);
+    size_t job = 0;
+    while (batch->firstTask[job + 1] <= p_Index) job++;
+
+    Rect procWindow = batch->jobs[job].window;
+    procWindow.y1 += (p_Index - batch->firstTask[job]) * kRowsPerTask;
+    procWindow.y2 = procWindow.y1 + kRowsPerTask < procWindow.y2 ? procWindow.y1 + kRowsPerTask : procWindow.y2;
+    processWindow(batch->jobs[job], procWindow);
+}
+
+bool processFrames(const FrameJob* p_Jobs, size_t p_Count, ThreadPool* p_Pool)
+{
+    for (size_t i = 0; i < p_Count; i++) {
+        if (!isSupported(p_Jobs[i])) return false;
+    }
+
+    // Fill in any occupancies we haven't been given. The jobs are the caller's, so we work on copies
+    std::vector<FrameJob> jobs(p_Jobs, p_Jobs + p_Count);
+    std::vector<MaskOccupancy> occupancies(p_Count);
+    for (size_t i = 0; i < p_Count; i++) {
+        if (jobs[i].mask.data && !jobs[i].occupancy) {
+            computeMaskOccupancy(jobs[i].mask, jobs[i].window, occupancies[i], p_Pool);
+            jobs[i].occupancy = &occupancies[i];
+        }
+    }
+
+    BatchTask batch;
+    batch.jobs = jobs.data();
+    batch.firstTask.push_back(0);
+    for (size_t i = 0; i < p_Count; i++) {
+        const int rows = jobs[i].window.y2 - jobs[i].window.y1;
+        batch.firstTask.push_back(batch.firstTask.back() + (rows > 0 ? (rows + kRowsPerTask - 1) / kRowsPerTask : 0));
+    }
+    runTasks(p_Pool, batch.firstTask.back(), processBatchTask, &batch);
+    return true;
+}
+
+bool processFrame(const FrameJob& p_Job, ThreadPool* p_Pool)
+{
+    return processFrames(&p_Job, 1, p_Pool);
+}
+
+} // namespace qualiflower
@@ -0,0 +1,145 @@
+#pragma once
+
+// libqualiflower: QualiFlower's qualifier without any OFX. It works in place on
+// buffers the caller owns, in whatever layout they're already in, on whatever
+// threads the caller gives it. The OFX plugin is a thin adapter over this.
+//
+// A minimal use, for one packed float rgba frame written to a separate matte:
+//
+//     qualiflower::FrameJob job;
+//     job.params.qualifier = ...;
+//     job.src = qualiflower::Frame(rgba, width, height, width * 16, qualiflower::eFormatRGBAFloat);
+//     job.dst = qualiflower::Frame(matte, width, height, width * 4, qualiflower::eFormatAlphaFloat);
+//     job.window = job.src.bounds;
+//     qualiflower::processFrame(job);
+
+#include <stddef.h>
+#include <vector>
+
+#include "hslqualifier.h"
+
+#ifdef QUALIFLOWER_SHARED
+#define QUALIFLOWER_API __attribute__((visibility("default")))
+#else
+#define QUALIFLOWER_API
+#endif
+
+namespace qualiflower {
+
+/** @brief A rectangle of pixels, [x1, x2) by [y1, y2). The same layout as OfxRectI */
+struct Rect
+{
+    int x1, y1, x2, y2;
+};
+
+enum PixelFormat
+{
+    eFormatNone,        // there's no image
+    eFormatRGBAFloat,
+    eFormatRGBFloat,
+    eFormatAlphaFloat,  // only as a matte destination, or a mask
+    eFormatRGBAByte,    // 0->255 is 0->1
+    eFormatRGBAShort,   // 0->65535 is 0->1
+};
+
+/** @brief A caller-owned image. Nothing gets copied. Pixel (x, y) is at
+    data + (y - bounds.y1) * rowBytes + (x - bounds.x1) * the pixel size, and rowBytes may be negative */
+struct QUALIFLOWER_API Frame
+{
+    Frame();
+    Frame(void* p_Data, int p_Width, int p_Height, ptrdiff_t p_RowBytes, PixelFormat p_Format);
+
+    void* data;
+    Rect bounds;
+    ptrdiff_t rowBytes;
+    PixelFormat format;
+};
+
+/** @brief Everything that gets applied to a frame */
+struct Params
+{
+    QualifierParams qualifier;
+    CorrectionParams correction;
+};
+
+// Number of rows in each strip of a mask occupancy map
+static const int kMaskStripHeight = 16;
+
+/** @brief Which parts of a window a mask leaves visible */
+struct MaskOccupancy
+{
+    Rect window;
+    // Bounding box of the non-zero mask pixels. Empty (y1 == y2) if there aren't any
+    Rect bounds;
+    // The non-zero horizontal extent of each kMaskStripHeight rows of the window. Empty strips have x1 >= x2
+    std::vector<Rect> strips;
+};
+
+/** @brief One frame's worth of work */
+struct QUALIFLOWER_API FrameJob
+{
+    FrameJob();
+
+    Params params;
+    // Must be rgba or rgb
+    Frame src;
+    // rgb gets the source (corrected inside the selection, if that's enabled) and alpha gets
+    // the matte. An alpha only dst just gets the matte. Can be eFormatNone
+    Frame dst;
+    // Optional. The matte is multiplied by its alpha, and nothing outside it gets evaluated
+    Frame mask;
+    // What to process, in image coordinates. Must be inside dst
+    Rect window;
+    // Optional, window sized. Gets this frame's matte, before it's averaged with any neighbourMattes
+    float* matte;
+    // Optional, window sized mattes of other frames, to average dst's alpha with
+    const float* const* neighbourMattes;
+    int neighbourMatteCount;
+    // Of mask over window. processFrame() and processFrames() work it out if it's not given,
+    // processWindow() needs it if there's a mask
+    const MaskOccupancy* occupancy;
+    // Optional, checked every row. If it returns true we stop where we are
+    bool (*abort)(void* p_Arg);
+    void* abortArg;
+};
+
+typedef void (*TaskFunction)(unsigned int p_Index, void* p_Arg);
+
+/** @brief Somewhere to run work in parallel. Without one, the library starts its own threads */
+class QUALIFLOWER_API ThreadPool
+{
+public:
+    virtual ~ThreadPool();
+
+    /* Roughly how many tasks are worth running at once */
+    virtual unsigned int threadCount() const = 0;
+
+    /* Call p_Function(i, p_Arg) for each i in [0, p_Count), in any order and on any threads,
+       and return once they've all finished */
+    virtual void run(unsigned int p_Count, TaskFunction p_Function, void* p_Arg) = 0;
+};
+
+/* Whether the library can do a job, going by its formats and whether its window is inside dst */
+QUALIFLOWER_API bool isSupported(const FrameJob& p_Job);
+
+/* Work out which parts of p_Window p_Mask leaves visible */
+QUALIFLOWER_API void computeMaskOccupancy(const Frame& p_Mask, const Rect& p_Window, MaskOccupancy& p_Occupancy,
+                                          ThreadPool* p_Pool = 0);
+
+/* The max(r, g, b) that p_Percentile percent of the pixels in p_Window of p_Src are at or below,
+   to within 1/16 of an octave, or exactly the brightest at 100. For normalising HDR luminance,
+   with luminanceScaleFor(). NaN, infinite and negative pixels count as black */
+QUALIFLOWER_API float whitePoint(const Frame& p_Src, const Rect& p_Window, double p_Percentile, ThreadPool* p_Pool = 0);
+
+/* Process p_ProcWindow, a part of p_Job.window, on the calling thread. This is for callers doing
+   their own threading; the job must be supported, and have its occupancy if it has a mask */
+QUALIFLOWER_API void processWindow(const FrameJob& p_Job, const Rect& p_ProcWindow);
+
+/* Process a frame. Returns false if it's not supported */
+QUALIFLOWER_API bool processFrame(const FrameJob& p_Job, ThreadPool* p_Pool = 0);
+
+/* Process a batch of frames, sharing the threads between all of them. Returns false, without
+   processing anything, if any of them aren't supported */
+QUALIFLOWER_API bool processFrames(const FrameJob* p_Jobs, size_t p_Count, ThreadPool* p_Pool = 0);
+
+} // namespace qualiflower
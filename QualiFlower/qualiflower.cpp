@@ -1,7 +1,12 @@
 #include "qualiflower.h"
+#include "hslqualifier.h"
+#include "libqualiflower.h"
 
 #include <stdio.h>
 #include <math.h>
+#include <map>
+#include <memory>
+#include <vector>
 
 #include "ofxsImageEffect.h"
 #include "ofxsMultiThread.h"
@@ -18,6 +23,123 @@
 #define kSupportsTiles false
 #define kSupportsMultiResolution false
 #define kSupportsMultipleClipPARs false
+// We slice each frame up between our own threads. If the host does it too, each slice is a
+// separate render window, and they won't be able to share cached mattes.
+#define kSupportsHostFrameThreading false
+
+// CUDA rendering is on everywhere but macOS, unless the plugin's built CPU only (make CUDA=0)
+#if !defined(__APPLE__) && !defined(QUALIFLOWER_NO_CUDA)
+#define QUALIFLOWER_CUDA
+#endif
+
+#define kMaskClipName "Mask"
+
+// Temporal smoothing averages over at most this many frames either side
+#define kMaxTemporalRadius 4
+// Enough cached mattes for the widest smoothing window, plus the next frame along
+#define kMaxCachedMattes (2 * kMaxTemporalRadius + 2)
+// White points are tiny, but each one took a pass over a whole frame
+#define kMaxCachedWhitePoints 64
+
+// What luminance 100 is. Clipping at 1 suits SDR, where HDR material wants normalising to a white
+// point from the frame itself. A percentile rather than the max stops a few specular
+// highlights squashing everything else down.
+enum LuminanceRange
+{
+    eLuminanceRangeClip,
+    eLuminanceRangeFrameMax,
+    eLuminanceRangeFramePercentile,
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// The pixel work is all done by libqualiflower. What's here just describes OFX images and
+// threads to it.
+
+/* Describe an OFX image to the library, without copying it. A null image is an empty frame */
+static qualiflower::Frame toFrame(OFX::Image* p_Img)
+{
+    qualiflower::Frame frame;
+    if (!p_Img) return frame;
+
+    const OfxRectI& bounds = p_Img->getBounds();
+    frame.data = p_Img->getPixelData();
+    frame.bounds.x1 = bounds.x1;
+    frame.bounds.y1 = bounds.y1;
+    frame.bounds.x2 = bounds.x2;
+    frame.bounds.y2 = bounds.y2;
+    frame.rowBytes = p_Img->getRowBytes();
+
+    if (p_Img->getPixelDepth() == OFX::eBitDepthFloat) {
+        switch (p_Img->getPixelComponents()) {
+        case OFX::ePixelComponentRGBA: frame.format = qualiflower::eFormatRGBAFloat; break;
+        case OFX::ePixelComponentRGB: frame.format = qualiflower::eFormatRGBFloat; break;
+        case OFX::ePixelComponentAlpha: frame.format = qualiflower::eFormatAlphaFloat; break;
+        default: break;
+        }
+    } else if (p_Img->getPixelComponents() == OFX::ePixelComponentRGBA) {
+        if (p_Img->getPixelDepth() == OFX::eBitDepthUByte) frame.format = qualiflower::eFormatRGBAByte;
+        if (p_Img->getPixelDepth() == OFX::eBitDepthUShort) frame.format = qualiflower::eFormatRGBAShort;
+    }
+    return frame;
+}
+
+static qualiflower::Rect toRect(const OfxRectI& p_Rect)
+{
+    qualiflower::Rect rect;
+    rect.x1 = p_Rect.x1;
+    rect.y1 = p_Rect.y1;
+    rect.x2 = p_Rect.x2;
+    rect.y2 = p_Rect.y2;
+    return rect;
+}
+
+static bool abortRender(void* p_Effect)
+{
+    return static_cast<OFX::ImageEffect*>(p_Effect)->abort();
+}
+
+/** @brief Runs the library's tasks on the host's threads */
+class HostThreadPool : public qualiflower::ThreadPool, public OFX::MultiThread::Processor
+{
+public:
+    HostThreadPool();
+
+    virtual unsigned int threadCount() const;
+    virtual void run(unsigned int p_Count, qualiflower::TaskFunction p_Function, void* p_Arg);
+    virtual void multiThreadFunction(unsigned int p_ThreadID, unsigned int p_NThreads);
+
+private:
+    unsigned int _count;
+    qualiflower::TaskFunction _function;
+    void* _arg;
+};
+
+HostThreadPool::HostThreadPool()
+    : _count(0)
+    , _function(0)
+    , _arg(0)
+{
+}
+
+unsigned int HostThreadPool::threadCount() const
+{
+    return OFX::MultiThread::getNumCPUs();
+}
+
+void HostThreadPool::run(unsigned int p_Count, qualiflower::TaskFunction p_Function, void* p_Arg)
+{
+    _count = p_Count;
+    _function = p_Function;
+    _arg = p_Arg;
+    multiThread(p_Count < threadCount() ? p_Count : threadCount());
+}
+
+void HostThreadPool::multiThreadFunction(unsigned int p_ThreadID, unsigned int p_NThreads)
+{
+    for (unsigned int i = p_ThreadID; i < _count; i += p_NThreads) {
+        _function(i, _arg);
+    }
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -30,231 +152,151 @@ public:
     virtual void multiThreadProcessImages(OfxRectI p_ProcWindow);
 
     void setSrcImg(OFX::Image* p_SrcImg);
-    void setParams(
-        bool p_hueEnabled, float p_hue, float p_hueWidth, float p_hueSoftness,
-        bool p_saturationEnabled, float p_saturationLow, float p_saturationHigh, float p_saturationLowSoftness, float p_saturationHighSoftness,
-        bool p_luminanceEnabled, float p_luminanceLow, float p_luminanceHigh, float p_luminanceLowSoftness, float p_luminanceHighSoftness
-    );
-
-
+    void setMaskImg(OFX::Image* p_MaskImg);
+    void setParams(const qualiflower::QualifierParams& p_Params);
+    void setCorrectionParams(const qualiflower::CorrectionParams& p_Correction);
+    /* Also write this frame's matte to a render window sized buffer */
+    void setMatteOutput(float* p_Matte);
+    /* Average these render window sized mattes from neighbouring frames into the output alpha */
+    void setNeighbourMattes(const std::vector<const float*>& p_Mattes);
+    /* Hand everything set so far to the library, and work out which parts of the render window
+       the mask leaves visible, so we can skip the rest. Needed before a CPU render */
+    void prepareJob();
 
 private:
     OFX::Image* _srcImg;
-    bool _hueEnabled, _saturationEnabled, _luminanceEnabled;
-    float _hue, _hueWidth, _hueSoftness;
-    float _saturationLow, _saturationHigh, _saturationLowSoftness, _saturationHighSoftness;
-    float _luminanceLow, _luminanceHigh, _luminanceLowSoftness, _luminanceHighSoftness;
+    OFX::Image* _maskImg;
+    std::vector<const float*> _neighbourMattes;
+    qualiflower::FrameJob _job;
+    qualiflower::MaskOccupancy _maskOccupancy;
 };
 
 ImageScaler::ImageScaler(OFX::ImageEffect& p_Instance)
     : OFX::ImageProcessor(p_Instance)
+    , _srcImg(0)
+    , _maskImg(0)
 {
+    _job.abort = abortRender;
+    _job.abortArg = &p_Instance;
 }
 
-#ifndef __APPLE__
+#ifdef QUALIFLOWER_CUDA
 extern void RunCudaKernel(
     void* p_Stream, int p_Width, int p_Height,
-    bool hueEnabled, float hue, float hueWidth, float hueSoftness,
-    bool saturationEnabled, float saturationLow, float saturationHigh, float saturationLowSoftness, float saturationHighSoftness,
-    bool luminanceEnabled, float luminanceLow, float luminanceHigh, float luminanceLowSoftness, float luminanceHighSoftness,
-    const float* p_Input, float* p_Output
+    const qualiflower::QualifierParams& p_Params, const qualiflower::CorrectionParams& p_Correction,
+    const float* p_Input, const float* p_Mask, int p_MaskX1, int p_MaskY1, int p_MaskX2, int p_MaskY2,
+    int p_MaskRowBytes, int p_MaskComponents, float* p_Output
 );
+
+extern float RunCudaWhitePoint(void* p_Stream, int p_Width, int p_Height, const float* p_Input, double p_Percentile);
 #endif
 
 void ImageScaler::processImagesCUDA()
 {
-#ifndef __APPLE__
+#ifdef QUALIFLOWER_CUDA
     const OfxRectI& bounds = _srcImg->getBounds();
     const int width = bounds.x2 - bounds.x1;
     const int height = bounds.y2 - bounds.y1;
 
     float* input = static_cast<float*>(_srcImg->getPixelData());
     float* output = static_cast<float*>(_dstImg->getPixelData());
+    // The mask is multiplied in on the GPU, but there's no bounding box culling there. Its bounds
+    // go to the kernel relative to the source's, and it's 0 outside them
+    const float* mask = _maskImg ? static_cast<float*>(_maskImg->getPixelData()) : 0;
+    const int maskComponents = _maskImg && _maskImg->getPixelComponents() == OFX::ePixelComponentAlpha ? 1 : 4;
+    OfxRectI maskBounds = { 0, 0, 0, 0 };
+    int maskRowBytes = 0;
+    if (_maskImg)
+    {
+        maskBounds = _maskImg->getBounds();
+        maskBounds.x1 -= bounds.x1;
+        maskBounds.y1 -= bounds.y1;
+        maskBounds.x2 -= bounds.x1;
+        maskBounds.y2 -= bounds.y1;
+        maskRowBytes = _maskImg->getRowBytes();
+    }
 
     RunCudaKernel(
         _pCudaStream, width, height,
-        _hueEnabled, _hue, _hueWidth, _hueSoftness,
-        _saturationEnabled, _saturationLow, _saturationHigh, _saturationLowSoftness, _saturationHighSoftness,
-        _luminanceEnabled, _luminanceLow, _luminanceHigh, _luminanceLowSoftness, _luminanceHighSoftness,
-        input, output
+        _job.params.qualifier, _job.params.correction,
+        input, mask, maskBounds.x1, maskBounds.y1, maskBounds.x2, maskBounds.y2,
+        maskRowBytes, maskComponents, output
     );
 #endif
 }
 
-
-void rgb2hsl(double r, double g, double b, double *h, double *s, double *l)
+void ImageScaler::multiThreadProcessImages(OfxRectI p_ProcWindow)
 {
-    // rgb are 0->1, return hsl as 0->100
-    double min, max, delta;
-
-    min = r < g ? r : g;
-    min = min  < b ? min : b;
-
-    max = r > g ? r : g;
-    max = max  > b ? max  : b;
-
-    // I seems these rgb values can be > 1. I'm going to just clamp them,
-    // but maybe the right thing would be to assume a range of 0->highest_value_in_image,
-    // rather than 1->1? Not sure.
-    *l = max >= 1.0 ? 100.0 : 100.0 * max;
+    qualiflower::processWindow(_job, toRect(p_ProcWindow));
+}
 
-    delta = max - min;
-    if (delta < 0.00001)
-    {
-        *s = 0;
-        *h = 0;
-        return;
-    }
-    if( max > 0.0 ) { // NOTE: if Max is == 0, this divide would cause a crash
-        *s = 100 * (delta / max);
-    } else {
-        *s = 0.0;
-        *h = NAN;
-        return;
-    }
-    if( r >= max ) {                 // > is bogus, just keeps compiler happy
-        *h = (g - b) / delta;        // between yellow & magenta
-    } else if(g >= max) {
-        *h = 2.0 + (b - r) / delta;  // between cyan & yellow
-    } else {
-        *h = 4.0 + (r - g) / delta;  // between magenta & cyan
-    }
+void ImageScaler::setSrcImg(OFX::Image* p_SrcImg)
+{
+    _srcImg = p_SrcImg;
+}
 
-//    *h *= 60.0;                              // degrees
-//    if(*h < 0.0 ) *h += 360.0;
-    *h *= 100.0 / 6.0;
-    if (*h < 0.0) *h += 100.0;
+void ImageScaler::setMaskImg(OFX::Image* p_MaskImg)
+{
+    _maskImg = p_MaskImg;
+}
 
-    return;
+void ImageScaler::setParams(const qualiflower::QualifierParams& p_Params)
+{
+    _job.params.qualifier = p_Params;
 }
 
+void ImageScaler::setCorrectionParams(const qualiflower::CorrectionParams& p_Correction)
+{
+    _job.params.correction = p_Correction;
+}
 
-void ImageScaler::multiThreadProcessImages(OfxRectI p_ProcWindow)
+void ImageScaler::setMatteOutput(float* p_Matte)
 {
-    double minHue, maxHue, overflowed_h, underflowed_h;
-    minHue = _hue - .5 * _hueWidth;
-    maxHue = _hue + .5 * _hueWidth;
-
-    int cc=0;
-    // and do some processing
-    double h, s, l;
-    double hue_multiplier, sat_multiplier, lum_multiplier;
-    double hue_lower_softness_threshold, hue_upper_softness_threshold;
-    hue_lower_softness_threshold = minHue - _hueSoftness;
-    hue_upper_softness_threshold = maxHue + _hueSoftness;
-
-    for(int y = p_ProcWindow.y1; y < p_ProcWindow.y2; y++) {
-        //if(y % 20 == 0 && gImageEffectSuite->abort(instance)) break;
-        if (_effect.abort()) break;
-
-        // get the row start for the output image
-        float* dstPix = static_cast<float*>(_dstImg->getPixelAddress(p_ProcWindow.x1, y));
-
-        for(int x = p_ProcWindow.x1; x < p_ProcWindow.x2; x++) {
-            // get the source pixel
-            float* srcPix = static_cast<float*>(_srcImg ? _srcImg->getPixelAddress(x, y) : 0);
-
-            if(srcPix) {
-                float r = srcPix[0];
-                float g = srcPix[1];
-                float b = srcPix[2];
-                rgb2hsl(r, g, b, &h, &s, &l);
-
-                if (_hueEnabled) {
-                    overflowed_h = h - 100.0;  // "wrapped around" hue, for testing against negative softness window
-                    underflowed_h = h + 100.0; // "wrapped around" hue, for testing against overflowed softness window
-                    if (h >= minHue && h <= maxHue) {
-                        hue_multiplier = 1.0;
-                    } else if (overflowed_h >= minHue && overflowed_h <= maxHue) {
-                        hue_multiplier = 1.0;
-                    } else if (underflowed_h >= minHue && underflowed_h <= maxHue) {
-                        hue_multiplier = 1.0;
-                    } else if (h > hue_lower_softness_threshold && h < minHue) {
-                        hue_multiplier = (h - hue_lower_softness_threshold) / _hueSoftness;
-                    } else if (overflowed_h > hue_lower_softness_threshold && overflowed_h < minHue) {
-                        hue_multiplier = (overflowed_h - hue_lower_softness_threshold) / _hueSoftness;
-                    } else if (h > maxHue && h <= hue_upper_softness_threshold) {
-                        hue_multiplier = (hue_upper_softness_threshold - h) / _hueSoftness;
-                    } else if (underflowed_h > maxHue && underflowed_h <= hue_upper_softness_threshold) {
-                        hue_multiplier = (hue_upper_softness_threshold - underflowed_h) / _hueSoftness;
-                    } else {
-                        hue_multiplier = 0.0;
-                    }
-                } else hue_multiplier = 1.0;
-                //if (cc<1) printf("%f %f %f min=%f max=%f a=%f\n", h, s, v, minHue, maxHue, a);
-                //if (cc<1) printf("%f %f %f min=%f max=%f\n", h, s, l, luminance_low, luminance_high);
-
-                if (_saturationEnabled) {
-                    if (s >= _saturationLow && s <= _saturationHigh) {
-                        sat_multiplier = 1.0;
-                    } else if (s < _saturationLow && s > _saturationLow - _saturationLowSoftness) {
-                        sat_multiplier = (s - (_saturationLow - _saturationLowSoftness)) / _saturationLowSoftness;
-                    } else if (s > _saturationHigh && s < _saturationHigh + _saturationHighSoftness){
-                        sat_multiplier = 1.0 - (s - _saturationHigh) / _saturationHighSoftness;
-                    } else {
-                        sat_multiplier = 0.0;
-                    }
-                } else sat_multiplier = 1.0;
-
-                if (_luminanceEnabled) {
-                    if (l >= _luminanceLow && l <= _luminanceHigh) {
-                        lum_multiplier = 1.0;
-                    } else if (l < _luminanceLow && l > _luminanceLow - _luminanceLowSoftness) {
-                        lum_multiplier = (l - (_luminanceLow - _luminanceLowSoftness)) / _luminanceLowSoftness;
-                    } else if (s > _luminanceHigh && l < _luminanceHigh + _luminanceHighSoftness){
-                        lum_multiplier = 1.0 - (l - _luminanceHigh) / _luminanceHighSoftness;
-                    } else {
-                        lum_multiplier = 0.0;
-                    }
-                } else lum_multiplier = 1.0;
-                //if (cc<1) printf("lum multiplier=%f\n", lum_multiplier);
-
-                dstPix[0] = r;
-                dstPix[1] = g;
-                dstPix[2] = b;
-                dstPix[3] = hue_multiplier * sat_multiplier * lum_multiplier;
-                srcPix += 4;
-                dstPix += 4;
-            } else {
-                // we don't have a pixel in the source image, set output to zero
-                for(int i = 0; i < 4; ++i) {
-                    *dstPix = 0;
-                    ++dstPix;
-                }
-            }
-        }
-        cc++;
-    }
+    _job.matte = p_Matte;
 }
 
-void ImageScaler::setSrcImg(OFX::Image* p_SrcImg)
+void ImageScaler::setNeighbourMattes(const std::vector<const float*>& p_Mattes)
 {
-    _srcImg = p_SrcImg;
+    _neighbourMattes = p_Mattes;
 }
 
-void ImageScaler::setParams(
-        bool p_hueEnabled, float p_hue, float p_hueWidth, float p_hueSoftness,
-        bool p_saturationEnabled, float p_saturationLow, float p_saturationHigh, float p_saturationLowSoftness, float p_saturationHighSoftness,
-        bool p_luminanceEnabled, float p_luminanceLow, float p_luminanceHigh, float p_luminanceLowSoftness, float p_luminanceHighSoftness
-)
+void ImageScaler::prepareJob()
 {
-    _hueEnabled = p_hueEnabled;
-    _hue = p_hue;
-    _hueWidth = p_hueWidth;
-    _hueSoftness = p_hueSoftness;
-    _saturationEnabled = p_saturationEnabled;
-    _saturationLow = p_saturationLow;
-    _saturationHigh = p_saturationHigh;
-    _saturationLowSoftness = p_saturationLowSoftness;
-    _saturationHighSoftness = p_saturationHighSoftness;
-    _luminanceEnabled = p_luminanceEnabled;
-    _luminanceLow = p_luminanceLow;
-    _luminanceHigh = p_luminanceHigh;
-    _luminanceLowSoftness = p_luminanceLowSoftness;
-    _luminanceHighSoftness = p_luminanceHighSoftness;
+    _job.src = toFrame(_srcImg);
+    _job.dst = toFrame(_dstImg);
+    _job.mask = toFrame(_maskImg);
+    _job.window = toRect(_renderWindow);
+    _job.neighbourMattes = _neighbourMattes.empty() ? 0 : &_neighbourMattes[0];
+    _job.neighbourMatteCount = static_cast<int>(_neighbourMattes.size());
+
+    if (!qualiflower::isSupported(_job))
+    {
+        OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
+    }
+
+    _job.occupancy = 0;
+    if (_maskImg)
+    {
+        HostThreadPool pool;
+        qualiflower::computeMaskOccupancy(_job.mask, _job.window, _maskOccupancy, &pool);
+        _job.occupancy = &_maskOccupancy;
+    }
 }
 
 
+/* Drop whichever entries of a time keyed cache are furthest from p_Time, until there are p_Max left */
+template <class T>
+static void dropFurthest(std::map<double, T>& p_Cache, double p_Time, size_t p_Max)
+{
+    while (p_Cache.size() > p_Max)
+    {
+        // The map is ordered by time, so the furthest away is at one end or the other
+        typename std::map<double, T>::iterator first = p_Cache.begin();
+        typename std::map<double, T>::iterator last = --p_Cache.end();
+        p_Cache.erase(p_Time - first->first > last->first - p_Time ? first : last);
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
 class QualiFlowerPlugin : public OFX::ImageEffect
@@ -274,16 +316,63 @@ public:
     /* Override changed clip */
     virtual void changedClip(const OFX::InstanceChangedArgs& p_Args, const std::string& p_ClipName);
 
+    /* Override the frames needed, so we can see our neighbours when smoothing over time */
+    virtual void getFramesNeeded(const OFX::FramesNeededArguments& p_Args, OFX::FramesNeededSetter& p_FramesNeededSetter);
+
+    /* Override purge caches */
+    virtual void purgeCaches();
+
     /* Set the enabledness of the params depending on the type of input image and the state of the checkboxes */
     void setEnabledness();
 
     /* Set up and run a processor */
     void setupAndProcess(ImageScaler &p_ImageScaler, const OFX::RenderArguments& p_Args);
 
+    /* Get the selection params at a given time. luminanceScale is left at 1, as it can need the image */
+    qualiflower::QualifierParams getParams(double p_Time) const;
+
+    /* Get the luminance scale at a given time, from the frame's white point if the luminance range
+       needs one. If p_UseCache is set, the white point comes from the cache if it's there.
+       Otherwise the source image gets fetched into p_Src if it's not there already, and if
+       p_CudaStream is set, the source image is on the GPU and the white point is worked out there.
+       Either way it's cached afterwards. */
+    float getLuminanceScale(double p_Time, std::auto_ptr<OFX::Image>& p_Src, bool p_UseCache, void* p_CudaStream = 0);
+
+    /* Get the colour correction params at a given time */
+    qualiflower::CorrectionParams getCorrectionParams(double p_Time) const;
+
+    /* Get the unsmoothed matte of the render window at a given time, from the cache if it's there */
+    std::shared_ptr<const std::vector<float> > getMatte(double p_Time, const OfxRectI& p_Window, bool p_Masked);
+
+    /* Get a cached matte, if there's one evaluated with these params, mask and window */
+    std::shared_ptr<const std::vector<float> > findCachedMatte(double p_Time, const qualiflower::QualifierParams& p_Params, bool p_Masked,
+                                                               const OfxRectI& p_Window);
+
+    /* Add a matte to the cache, dropping whichever cached mattes are furthest away in time */
+    void cacheMatte(double p_Time, const qualiflower::QualifierParams& p_Params, bool p_Masked, const OfxRectI& p_Window,
+                    const std::shared_ptr<const std::vector<float> >& p_Matte);
+
 private:
+    /** @brief A single channel matte, and what it was evaluated with */
+    struct CachedMatte
+    {
+        qualiflower::QualifierParams params;
+        bool masked;
+        OfxRectI window;
+        std::shared_ptr<const std::vector<float> > matte;
+    };
+
+    /** @brief A frame's white point, and the percentile it's at (100 for the max) */
+    struct CachedWhitePoint
+    {
+        double percentile;
+        float whitePoint;
+    };
+
     // Does not own the following pointers
     OFX::Clip* m_DstClip;
     OFX::Clip* m_SrcClip;
+    OFX::Clip* m_MaskClip; // Null outside the general context
 
     OFX::DoubleParam* m_Scale;
     OFX::DoubleParam* m_ScaleR;
@@ -308,7 +397,27 @@ private:
     OFX::DoubleParam* m_luminanceHigh;
     OFX::DoubleParam* m_luminanceLowSoftness;
     OFX::DoubleParam* m_luminanceHighSoftness;
-
+    OFX::ChoiceParam* m_luminanceRange;
+    OFX::DoubleParam* m_luminancePercentile;
+
+    OFX::BooleanParam* m_correctionEnabled;
+    OFX::DoubleParam* m_hueShift;
+    OFX::DoubleParam* m_saturationGain;
+    OFX::DoubleParam* m_lift;
+    OFX::DoubleParam* m_gamma;
+    OFX::DoubleParam* m_gain;
+    OFX::DoubleParam* m_despill;
+
+    OFX::BooleanParam* m_temporalSmoothingEnabled;
+    OFX::IntParam* m_temporalRadius;
+
+    // Recent unsmoothed mattes, keyed on time
+    OFX::MultiThread::Mutex m_MatteCacheMutex;
+    std::map<double, CachedMatte> m_MatteCache;
+
+    // White points of the source, keyed on time
+    OFX::MultiThread::Mutex m_WhitePointCacheMutex;
+    std::map<double, CachedWhitePoint> m_WhitePointCache;
 };
 
 QualiFlowerPlugin::QualiFlowerPlugin(OfxImageEffectHandle p_Handle)
@@ -316,6 +425,8 @@ QualiFlowerPlugin::QualiFlowerPlugin(OfxImageEffectHandle p_Handle)
 {
     m_DstClip = fetchClip(kOfxImageEffectOutputClipName);
     m_SrcClip = fetchClip(kOfxImageEffectSimpleSourceClipName);
+    // The mask is only defined in the general context
+    m_MaskClip = getContext() == OFX::eContextGeneral ? fetchClip(kMaskClipName) : 0;
 
     m_hueEnabled = fetchBooleanParam("selectByHueEnabled");
     m_hue = fetchDoubleParam("hue");
@@ -333,6 +444,19 @@ QualiFlowerPlugin::QualiFlowerPlugin(OfxImageEffectHandle p_Handle)
     m_luminanceHigh = fetchDoubleParam("luminanceHigh");
     m_luminanceLowSoftness = fetchDoubleParam("luminanceLowSoftness");
     m_luminanceHighSoftness = fetchDoubleParam("luminanceHighSoftness");
+    m_luminanceRange = fetchChoiceParam("luminanceRange");
+    m_luminancePercentile = fetchDoubleParam("luminancePercentile");
+
+    m_correctionEnabled = fetchBooleanParam("correctionEnabled");
+    m_hueShift = fetchDoubleParam("hueShift");
+    m_saturationGain = fetchDoubleParam("saturationGain");
+    m_lift = fetchDoubleParam("lift");
+    m_gamma = fetchDoubleParam("gamma");
+    m_gain = fetchDoubleParam("gain");
+    m_despill = fetchDoubleParam("despill");
+
+    m_temporalSmoothingEnabled = fetchBooleanParam("temporalSmoothingEnabled");
+    m_temporalRadius = fetchIntParam("temporalRadius");
 
     // Set the enabledness of our sliders
     setEnabledness();
@@ -356,8 +480,9 @@ bool QualiFlowerPlugin::isIdentity(const OFX::IsIdentityArguments& p_Args, OFX::
     bool hueEnabled = m_hueEnabled->getValueAtTime(p_Args.time);
     bool saturationEnabled = m_saturationEnabled->getValueAtTime(p_Args.time);
     bool luminanceEnabled = m_luminanceEnabled->getValueAtTime(p_Args.time);
+    bool correctionEnabled = m_correctionEnabled->getValueAtTime(p_Args.time);
     // TODO: Could also check for all 0-100% values here
-    if (!hueEnabled && !saturationEnabled && !luminanceEnabled) {
+    if (!hueEnabled && !saturationEnabled && !luminanceEnabled && !correctionEnabled) {
          p_IdentityClip = m_SrcClip;
          p_IdentityTime = p_Args.time;
         return true;
@@ -371,6 +496,9 @@ void QualiFlowerPlugin::changedParam(const OFX::InstanceChangedArgs& p_Args, con
         p_ParamName == "selectByHueEnabled"
         || (p_ParamName == "selectBySaturationEnabled")
         || (p_ParamName == "selectByLuminanceEnabled")
+        || (p_ParamName == "luminanceRange")
+        || (p_ParamName == "correctionEnabled")
+        || (p_ParamName == "temporalSmoothingEnabled")
     )
     {
         setEnabledness();
@@ -383,6 +511,38 @@ void QualiFlowerPlugin::changedClip(const OFX::InstanceChangedArgs& p_Args, cons
     {
         setEnabledness();
     }
+    if (p_ClipName == kOfxImageEffectSimpleSourceClipName || p_ClipName == kMaskClipName)
+    {
+        purgeCaches();
+    }
+}
+
+void QualiFlowerPlugin::getFramesNeeded(const OFX::FramesNeededArguments& p_Args, OFX::FramesNeededSetter& p_FramesNeededSetter)
+{
+    OfxRangeD range;
+    range.min = p_Args.time;
+    range.max = p_Args.time;
+    if (m_temporalSmoothingEnabled->getValueAtTime(p_Args.time))
+    {
+        const int radius = m_temporalRadius->getValueAtTime(p_Args.time);
+        range.min -= radius;
+        range.max += radius;
+    }
+    p_FramesNeededSetter.setFramesNeeded(*m_SrcClip, range);
+    if (m_MaskClip && m_MaskClip->isConnected())
+    {
+        p_FramesNeededSetter.setFramesNeeded(*m_MaskClip, range);
+    }
+}
+
+void QualiFlowerPlugin::purgeCaches()
+{
+    {
+        OFX::MultiThread::AutoMutex lock(m_MatteCacheMutex);
+        m_MatteCache.clear();
+    }
+    OFX::MultiThread::AutoMutex lock(m_WhitePointCacheMutex);
+    m_WhitePointCache.clear();
 }
 
 void QualiFlowerPlugin::setEnabledness()
@@ -402,6 +562,16 @@ void QualiFlowerPlugin::setEnabledness()
     m_luminanceLowSoftness->setEnabled(enableLuminance);
     m_luminanceHigh->setEnabled(enableLuminance);
     m_luminanceHighSoftness->setEnabled(enableLuminance);
+    m_luminanceRange->setEnabled(enableLuminance);
+    m_luminancePercentile->setEnabled(enableLuminance && m_luminanceRange->getValue() == eLuminanceRangeFramePercentile);
+    const bool enableCorrection = m_correctionEnabled->getValue();
+    m_hueShift->setEnabled(enableCorrection);
+    m_saturationGain->setEnabled(enableCorrection);
+    m_lift->setEnabled(enableCorrection);
+    m_gamma->setEnabled(enableCorrection);
+    m_gain->setEnabled(enableCorrection);
+    m_despill->setEnabled(enableCorrection);
+    m_temporalRadius->setEnabled(m_temporalSmoothingEnabled->getValue());
 }
 
 void QualiFlowerPlugin::setupAndProcess(ImageScaler& p_ImageScaler, const OFX::RenderArguments& p_Args)
@@ -422,24 +592,28 @@ void QualiFlowerPlugin::setupAndProcess(ImageScaler& p_ImageScaler, const OFX::R
         OFX::throwSuiteStatusException(kOfxStatErrValue);
     }
 
-    bool hueEnabled = m_hueEnabled->getValueAtTime(p_Args.time);
-    float hue = m_hue->getValueAtTime(p_Args.time);
-    float hueWidth = m_hueWidth->getValueAtTime(p_Args.time);
-    float hueSoftness = m_hueSoftness->getValueAtTime(p_Args.time);
-    bool saturationEnabled = m_saturationEnabled->getValueAtTime(p_Args.time);
-    float saturationLow = m_saturationLow->getValueAtTime(p_Args.time);
-    float saturationHigh = m_saturationHigh->getValueAtTime(p_Args.time);
-    float saturationLowSoftness = m_saturationLowSoftness->getValueAtTime(p_Args.time);
-    float saturationHighSoftness = m_saturationHighSoftness->getValueAtTime(p_Args.time);
-    bool luminanceEnabled = m_luminanceEnabled->getValueAtTime(p_Args.time);
-    float luminanceLow = m_luminanceLow->getValueAtTime(p_Args.time);
-    float luminanceHigh = m_luminanceHigh->getValueAtTime(p_Args.time);
-    float luminanceLowSoftness = m_luminanceLowSoftness->getValueAtTime(p_Args.time);
-    float luminanceHighSoftness = m_luminanceHighSoftness->getValueAtTime(p_Args.time);
+    // Get the mask image, if there is one. Whether it's connected is only read the once,
+    // so the whole render agrees about it.
+    const bool masked = m_MaskClip && m_MaskClip->isConnected();
+    std::auto_ptr<OFX::Image> mask(masked ? m_MaskClip->fetchImage(p_Args.time) : 0);
+    if (mask.get() && mask->getPixelDepth() != dstBitDepth)
+    {
+        OFX::throwSuiteStatusException(kOfxStatErrValue);
+    }
+
+    // Snapshot the params, so everything this render does uses the same values
+    qualiflower::QualifierParams params = getParams(p_Args.time);
+    // The source is already here, so its white point is always worked out afresh. Nothing tells
+    // us when something upstream changes it, and a cached one could be stale.
+    params.luminanceScale = getLuminanceScale(p_Args.time, src, false, p_Args.isEnabledCudaRender ? p_Args.pCudaStream : 0);
+    const qualiflower::CorrectionParams correction = getCorrectionParams(p_Args.time);
+    const bool temporalSmoothing = m_temporalSmoothingEnabled->getValueAtTime(p_Args.time);
+    const int temporalRadius = m_temporalRadius->getValueAtTime(p_Args.time);
 
     // Set the images
     p_ImageScaler.setDstImg(dst.get());
     p_ImageScaler.setSrcImg(src.get());
+    p_ImageScaler.setMaskImg(mask.get());
 
     // Setup OpenCL and CUDA Render arguments
     p_ImageScaler.setGPURenderArgs(p_Args);
@@ -447,14 +621,196 @@ void QualiFlowerPlugin::setupAndProcess(ImageScaler& p_ImageScaler, const OFX::R
     // Set the render window
     p_ImageScaler.setRenderWindow(p_Args.renderWindow);
 
-    p_ImageScaler.setParams(
-        hueEnabled, hue, hueWidth, hueSoftness,
-        saturationEnabled, saturationLow, saturationHigh, saturationLowSoftness, saturationHighSoftness,
-        luminanceEnabled, luminanceLow, luminanceHigh, luminanceLowSoftness, luminanceHighSoftness
-    );
+    p_ImageScaler.setParams(params);
+    p_ImageScaler.setCorrectionParams(correction);
+
+    // Temporal smoothing averages this frame's matte with the cached mattes of its neighbours.
+    // It's CPU only, as GPU images aren't readable from here.
+    std::shared_ptr<std::vector<float> > matte;
+    std::vector<std::shared_ptr<const std::vector<float> > > neighbours;
+    if (!p_Args.isEnabledCudaRender && temporalSmoothing)
+    {
+        const OfxRangeD frameRange = m_SrcClip->getFrameRange();
+        std::vector<const float*> neighbourMattes;
+        for (int i = -temporalRadius; i <= temporalRadius; i++)
+        {
+            const double time = p_Args.time + i;
+            if (i == 0 || time < frameRange.min || time > frameRange.max) continue;
+
+            std::shared_ptr<const std::vector<float> > neighbour = getMatte(time, p_Args.renderWindow, masked);
+            if (abort()) return;
+            if (!neighbour) continue;
+            neighbours.push_back(neighbour);
+            neighbourMattes.push_back(neighbour->data());
+        }
+        p_ImageScaler.setNeighbourMattes(neighbourMattes);
+
+        // This frame's matte is always evaluated again, as the cache can't tell if something upstream
+        // changed the source. It replaces any cached one, for the next frames to use.
+        const OfxRectI& window = p_Args.renderWindow;
+        matte.reset(new std::vector<float>(static_cast<size_t>(window.x2 - window.x1) * (window.y2 - window.y1)));
+        p_ImageScaler.setMatteOutput(matte->data());
+    }
+
+    // On the CPU we only evaluate the parts of the frame the mask leaves visible. GPU images
+    // aren't readable from here, so the CUDA kernel just multiplies the mask in.
+    if (!p_Args.isEnabledCudaRender)
+    {
+        p_ImageScaler.prepareJob();
+    }
 
     // Call the base class process member, this will call the derived templated process code
     p_ImageScaler.process();
+
+    if (matte && !abort())
+    {
+        cacheMatte(p_Args.time, params, masked, p_Args.renderWindow, matte);
+    }
+}
+
+qualiflower::QualifierParams QualiFlowerPlugin::getParams(double p_Time) const
+{
+    qualiflower::QualifierParams params;
+    params.hueEnabled = m_hueEnabled->getValueAtTime(p_Time);
+    params.hue = m_hue->getValueAtTime(p_Time);
+    params.hueWidth = m_hueWidth->getValueAtTime(p_Time);
+    params.hueSoftness = m_hueSoftness->getValueAtTime(p_Time);
+    params.saturationEnabled = m_saturationEnabled->getValueAtTime(p_Time);
+    params.saturationLow = m_saturationLow->getValueAtTime(p_Time);
+    params.saturationHigh = m_saturationHigh->getValueAtTime(p_Time);
+    params.saturationLowSoftness = m_saturationLowSoftness->getValueAtTime(p_Time);
+    params.saturationHighSoftness = m_saturationHighSoftness->getValueAtTime(p_Time);
+    params.luminanceEnabled = m_luminanceEnabled->getValueAtTime(p_Time);
+    params.luminanceLow = m_luminanceLow->getValueAtTime(p_Time);
+    params.luminanceHigh = m_luminanceHigh->getValueAtTime(p_Time);
+    params.luminanceLowSoftness = m_luminanceLowSoftness->getValueAtTime(p_Time);
+    params.luminanceHighSoftness = m_luminanceHighSoftness->getValueAtTime(p_Time);
+    params.luminanceScale = 1.0f;
+    return params;
+}
+
+float QualiFlowerPlugin::getLuminanceScale(double p_Time, std::auto_ptr<OFX::Image>& p_Src, bool p_UseCache, void* p_CudaStream)
+{
+    const int range = m_luminanceRange->getValueAtTime(p_Time);
+    if (!m_luminanceEnabled->getValueAtTime(p_Time) || range == eLuminanceRangeClip) return 1.0f;
+    const double percentile = range == eLuminanceRangeFrameMax ? 100.0 : m_luminancePercentile->getValueAtTime(p_Time);
+
+    if (p_UseCache)
+    {
+        OFX::MultiThread::AutoMutex lock(m_WhitePointCacheMutex);
+        std::map<double, CachedWhitePoint>::const_iterator it = m_WhitePointCache.find(p_Time);
+        if (it != m_WhitePointCache.end() && it->second.percentile == percentile)
+        {
+            return qualiflower::luminanceScaleFor(it->second.whitePoint);
+        }
+    }
+
+    if (!p_Src.get()) p_Src.reset(m_SrcClip->fetchImage(p_Time));
+    if (!p_Src.get()) return 1.0f;
+
+    // It's the white point of the whole frame rather than the render window, so that every
+    // render of a frame, and the neighbouring mattes of temporal smoothing, all agree on it
+    float whitePoint = 0.0f;
+    if (p_CudaStream)
+    {
+#ifdef QUALIFLOWER_CUDA
+        const OfxRectI& bounds = p_Src->getBounds();
+        whitePoint = RunCudaWhitePoint(p_CudaStream, bounds.x2 - bounds.x1, bounds.y2 - bounds.y1,
+                                       static_cast<const float*>(p_Src->getPixelData()), percentile);
+#endif
+    }
+    else
+    {
+        const qualiflower::Frame src = toFrame(p_Src.get());
+        HostThreadPool pool;
+        whitePoint = qualiflower::whitePoint(src, src.bounds, percentile, &pool);
+    }
+    if (abort()) return qualiflower::luminanceScaleFor(whitePoint);
+
+    CachedWhitePoint cached;
+    cached.percentile = percentile;
+    cached.whitePoint = whitePoint;
+    OFX::MultiThread::AutoMutex lock(m_WhitePointCacheMutex);
+    m_WhitePointCache[p_Time] = cached;
+    dropFurthest(m_WhitePointCache, p_Time, kMaxCachedWhitePoints);
+    return qualiflower::luminanceScaleFor(whitePoint);
+}
+
+qualiflower::CorrectionParams QualiFlowerPlugin::getCorrectionParams(double p_Time) const
+{
+    qualiflower::CorrectionParams correction;
+    correction.enabled = m_correctionEnabled->getValueAtTime(p_Time);
+    correction.hueShift = m_hueShift->getValueAtTime(p_Time);
+    correction.saturationGain = m_saturationGain->getValueAtTime(p_Time);
+    correction.lift = m_lift->getValueAtTime(p_Time);
+    correction.gamma = m_gamma->getValueAtTime(p_Time);
+    correction.gain = m_gain->getValueAtTime(p_Time);
+    correction.despill = m_despill->getValueAtTime(p_Time);
+    correction.despillChannel = qualiflower::nearestChannel(m_hue->getValueAtTime(p_Time));
+    return correction;
+}
+
+std::shared_ptr<const std::vector<float> > QualiFlowerPlugin::getMatte(double p_Time, const OfxRectI& p_Window, bool p_Masked)
+{
+    // The white point is normally cached by that frame's own render, so this rarely needs the image
+    std::auto_ptr<OFX::Image> src;
+    qualiflower::QualifierParams params = getParams(p_Time);
+    params.luminanceScale = getLuminanceScale(p_Time, src, true);
+    std::shared_ptr<const std::vector<float> > cached = findCachedMatte(p_Time, params, p_Masked, p_Window);
+    if (cached) return cached;
+
+    // Not cached, so evaluate it. There's no dst image, just the matte. If another render
+    // wants the same matte at the same time they'll both make it, and the second one wins.
+    if (!src.get()) src.reset(m_SrcClip->fetchImage(p_Time));
+    if (!src.get()) return std::shared_ptr<const std::vector<float> >();
+    std::auto_ptr<OFX::Image> mask(p_Masked && m_MaskClip ? m_MaskClip->fetchImage(p_Time) : 0);
+
+    std::shared_ptr<std::vector<float> > matte(
+        new std::vector<float>(static_cast<size_t>(p_Window.x2 - p_Window.x1) * (p_Window.y2 - p_Window.y1)));
+    qualiflower::FrameJob job;
+    job.params.qualifier = params;
+    job.src = toFrame(src.get());
+    job.mask = toFrame(mask.get());
+    job.window = toRect(p_Window);
+    job.matte = matte->data();
+    job.abort = abortRender;
+    job.abortArg = this;
+    HostThreadPool pool;
+    if (!qualiflower::processFrame(job, &pool)) return std::shared_ptr<const std::vector<float> >();
+
+    if (abort()) return std::shared_ptr<const std::vector<float> >();
+    cacheMatte(p_Time, params, p_Masked, p_Window, matte);
+    return matte;
+}
+
+std::shared_ptr<const std::vector<float> > QualiFlowerPlugin::findCachedMatte(double p_Time, const qualiflower::QualifierParams& p_Params,
+                                                                              bool p_Masked, const OfxRectI& p_Window)
+{
+    OFX::MultiThread::AutoMutex lock(m_MatteCacheMutex);
+    std::map<double, CachedMatte>::const_iterator it = m_MatteCache.find(p_Time);
+    if (it != m_MatteCache.end()
+        && it->second.params == p_Params
+        && it->second.masked == p_Masked
+        && it->second.window.x1 == p_Window.x1 && it->second.window.y1 == p_Window.y1
+        && it->second.window.x2 == p_Window.x2 && it->second.window.y2 == p_Window.y2)
+    {
+        return it->second.matte;
+    }
+    return std::shared_ptr<const std::vector<float> >();
+}
+
+void QualiFlowerPlugin::cacheMatte(double p_Time, const qualiflower::QualifierParams& p_Params, bool p_Masked, const OfxRectI& p_Window,
+                                   const std::shared_ptr<const std::vector<float> >& p_Matte)
+{
+    CachedMatte cached;
+    cached.params = p_Params;
+    cached.masked = p_Masked;
+    cached.window = p_Window;
+    cached.matte = p_Matte;
+
+    OFX::MultiThread::AutoMutex lock(m_MatteCacheMutex);
+    m_MatteCache[p_Time] = cached;
+    dropFurthest(m_MatteCache, p_Time, kMaxCachedMattes);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -482,18 +838,22 @@ void QualiFlowerPluginFactory::describe(OFX::ImageEffectDescriptor& p_Desc)
 
     // Set a few flags
     p_Desc.setSingleInstance(false);
-    p_Desc.setHostFrameThreading(false);
+    p_Desc.setHostFrameThreading(kSupportsHostFrameThreading);
     p_Desc.setSupportsMultiResolution(kSupportsMultiResolution);
     p_Desc.setSupportsTiles(kSupportsTiles);
-    p_Desc.setTemporalClipAccess(false);
+    p_Desc.setTemporalClipAccess(true);
     p_Desc.setRenderTwiceAlways(false);
     p_Desc.setSupportsMultipleClipPARs(kSupportsMultipleClipPARs);
 
+    // Renders only share the matte cache, which is locked, so the host can render
+    // several frames with the same instance at once.
+    p_Desc.setRenderThreadSafety(eRenderFullySafe);
+
     // Setup OpenCL render capability flags
     p_Desc.setSupportsOpenCLRender(false);
 
-    // Setup CUDA render capability flags on non-Apple system
-#ifndef __APPLE__
+    // Setup CUDA render capability flags, if it's been built with CUDA
+#ifdef QUALIFLOWER_CUDA
     p_Desc.setSupportsCudaRender(true);
     p_Desc.setSupportsCudaStream(true);
 #endif
@@ -503,9 +863,9 @@ void QualiFlowerPluginFactory::describe(OFX::ImageEffectDescriptor& p_Desc)
      p_Desc.setSupportsMetalRender(false);
 #endif
 
-    // Indicates that the plugin output does not depend on location or neighbours of a given pixel.
-    // Therefore, this plugin could be executed during LUT generation.
-    p_Desc.setNoSpatialAwareness(true);
+    // The output depends on where a pixel is (the mask) and on other frames (temporal smoothing),
+    // so this plugin can't be baked into a LUT.
+    p_Desc.setNoSpatialAwareness(false);
 }
 
 static DoubleParamDescriptor* defineScaleParam(OFX::ImageEffectDescriptor& p_Desc, const std::string& p_Name, const std::string& p_Label,
@@ -529,17 +889,51 @@ static DoubleParamDescriptor* defineScaleParam(OFX::ImageEffectDescriptor& p_Des
     return param;
 }
 
+static DoubleParamDescriptor* defineCorrectionParam(OFX::ImageEffectDescriptor& p_Desc, const std::string& p_Name, const std::string& p_Label,
+                                                    const std::string& p_Hint, GroupParamDescriptor* p_Parent,
+                                                    double p_Default, double p_Min, double p_Max, double p_DisplayMin, double p_DisplayMax)
+{
+    DoubleParamDescriptor* param = p_Desc.defineDoubleParam(p_Name);
+    param->setLabels(p_Label, p_Label, p_Label);
+    param->setScriptName(p_Name);
+    param->setHint(p_Hint);
+    param->setDefault(p_Default);
+    param->setRange(p_Min, p_Max);
+    param->setIncrement(0.01);
+    param->setDisplayRange(p_DisplayMin, p_DisplayMax);
+    param->setDoubleType(eDoubleTypePlain);
 
-void QualiFlowerPluginFactory::describeInContext(OFX::ImageEffectDescriptor& p_Desc, OFX::ContextEnum /*p_Context*/)
+    if (p_Parent)
+    {
+        param->setParent(*p_Parent);
+    }
+
+    return param;
+}
+
+void QualiFlowerPluginFactory::describeInContext(OFX::ImageEffectDescriptor& p_Desc, OFX::ContextEnum p_Context)
 {
     // Source clip only in the filter context
     // Create the mandated source clip
     ClipDescriptor* srcClip = p_Desc.defineClip(kOfxImageEffectSimpleSourceClipName);
     srcClip->addSupportedComponent(ePixelComponentRGBA);
-    srcClip->setTemporalClipAccess(false);
+    srcClip->setTemporalClipAccess(true);
     srcClip->setSupportsTiles(kSupportsTiles);
     srcClip->setIsMask(false);
 
+    // Optional garbage mask. The matte is multiplied by it, and nothing outside it gets evaluated.
+    // A filter only has the one input, so the mask is only in the general context.
+    if (p_Context == eContextGeneral)
+    {
+        ClipDescriptor* maskClip = p_Desc.defineClip(kMaskClipName);
+        maskClip->addSupportedComponent(ePixelComponentAlpha);
+        maskClip->addSupportedComponent(ePixelComponentRGBA);
+        maskClip->setTemporalClipAccess(true);
+        maskClip->setSupportsTiles(kSupportsTiles);
+        maskClip->setOptional(true);
+        maskClip->setIsMask(true);
+    }
+
     // Create the mandated output clip
     ClipDescriptor* dstClip = p_Desc.defineClip(kOfxImageEffectOutputClipName);
     dstClip->addSupportedComponent(ePixelComponentRGBA);
@@ -598,6 +992,76 @@ void QualiFlowerPluginFactory::describeInContext(OFX::ImageEffectDescriptor& p_D
     page->addChild(*param);
     param = defineScaleParam(p_Desc, "luminanceHighSoftness", "Luminance High Softness", "Luminance High softness", selectionGroup);
     page->addChild(*param);
+    ChoiceParamDescriptor* choiceParam = p_Desc.defineChoiceParam("luminanceRange");
+    choiceParam->setLabels("Luminance Range", "Luminance Range", "Luminance Range");
+    choiceParam->setHint("What luminance 100 is. Normalising to the frame suits HDR and log material, where a lot is above 1.0");
+    choiceParam->appendOption("Clip at 1.0", "Anything at or above 1.0 is 100");
+    choiceParam->appendOption("Frame Maximum", "The brightest pixel of each frame is 100");
+    choiceParam->appendOption("Frame Percentile", "Luminance Percentile percent of each frame is at or below 100");
+    choiceParam->setDefault(eLuminanceRangeClip);
+    choiceParam->setParent(*selectionGroup);
+    page->addChild(*choiceParam);
+    param = p_Desc.defineDoubleParam("luminancePercentile");
+    param->setLabels("Luminance Percentile", "Luminance Percentile", "Luminance Percentile");
+    param->setScriptName("luminancePercentile");
+    param->setHint("How much of each frame is at or below luminance 100, with the Frame Percentile range");
+    param->setDefault(99.5);
+    param->setRange(50, 100);
+    param->setIncrement(0.1);
+    param->setDisplayRange(90, 100);
+    param->setDoubleType(eDoubleTypePlain);
+    param->setParent(*selectionGroup);
+    page->addChild(*param);
+
+    // Group param for correcting the colour inside the selection
+    GroupParamDescriptor* correctionGroup = p_Desc.defineGroupParam("Correction");
+    correctionGroup->setHint("Colour correction inside the selection");
+    correctionGroup->setLabels("Correction", "Correction", "Correction");
+
+    boolParam = p_Desc.defineBooleanParam("correctionEnabled");
+    boolParam->setDefault(false);
+    boolParam->setHint("Correct the colour inside the selection, weighted by the matte");
+    boolParam->setLabels("Correct Selection", "Correct Selection", "Correct Selection");
+    boolParam->setParent(*correctionGroup);
+    page->addChild(*boolParam);
+    param = defineCorrectionParam(p_Desc, "hueShift", "Hue Shift", "Hue shift, in the same units as Hue", correctionGroup, 0, -50, 50, -50, 50);
+    page->addChild(*param);
+    param = defineCorrectionParam(p_Desc, "saturationGain", "Saturation Gain", "Saturation multiplier", correctionGroup, 1, 0, 10, 0, 2);
+    page->addChild(*param);
+    param = defineCorrectionParam(p_Desc, "lift", "Lift", "Lift", correctionGroup, 0, -1, 1, -0.5, 0.5);
+    page->addChild(*param);
+    param = defineCorrectionParam(p_Desc, "gamma", "Gamma", "Gamma", correctionGroup, 1, 0.1, 10, 0.2, 5);
+    page->addChild(*param);
+    param = defineCorrectionParam(p_Desc, "gain", "Gain", "Gain", correctionGroup, 1, 0, 10, 0, 4);
+    page->addChild(*param);
+    param = defineCorrectionParam(p_Desc, "despill", "Despill", "Pull the channel closest to the selected hue down towards the other two", correctionGroup, 0, 0, 1, 0, 1);
+    page->addChild(*param);
+
+    // Group param for temporal smoothing of the matte
+    GroupParamDescriptor* temporalGroup = p_Desc.defineGroupParam("Temporal");
+    temporalGroup->setHint("Temporal matte smoothing");
+    temporalGroup->setLabels("Temporal", "Temporal", "Temporal");
+
+    boolParam = p_Desc.defineBooleanParam("temporalSmoothingEnabled");
+    boolParam->setDefault(false);
+#ifdef QUALIFLOWER_CUDA
+    // GPU images aren't readable from the plugin, so say so rather than silently not smoothing
+    boolParam->setHint("Average the matte with the mattes of neighbouring frames, to reduce flicker. "
+                       "CPU renders only: with GPU rendering on, the matte isn't smoothed");
+#else
+    boolParam->setHint("Average the matte with the mattes of neighbouring frames, to reduce flicker");
+#endif
+    boolParam->setLabels("Smooth Over Time", "Smooth Over Time", "Smooth Over Time");
+    boolParam->setParent(*temporalGroup);
+    page->addChild(*boolParam);
+    IntParamDescriptor* intParam = p_Desc.defineIntParam("temporalRadius");
+    intParam->setLabels("Temporal Radius", "Temporal Radius", "Temporal Radius");
+    intParam->setHint("Number of frames either side of the current one to average the matte over");
+    intParam->setDefault(1);
+    intParam->setRange(1, kMaxTemporalRadius);
+    intParam->setDisplayRange(1, kMaxTemporalRadius);
+    intParam->setParent(*temporalGroup);
+    page->addChild(*intParam);
 }
 
 ImageEffect* QualiFlowerPluginFactory::createInstance(OfxImageEffectHandle p_Handle, ContextEnum /*p_Context*/)
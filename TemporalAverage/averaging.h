@@ -0,0 +1,62 @@
+#pragma once
+
+// The pixel maths of the temporal average. This doesn't depend on OFX, so it
+// can be benchmarked on its own. PIX is any 8 bit rgba struct, like OfxRGBAColourB.
+
+template <class PIX>
+inline void averageRow(const PIX *prevPix, const PIX *curPix, const PIX *nextPix, PIX *dstPix, int count)
+{
+  for(int i = 0; i < count; i++) {
+    dstPix->r = (prevPix->r + curPix->r + nextPix->r) / 3;
+    dstPix->g = (prevPix->g + curPix->g + nextPix->g) / 3;
+    dstPix->b = (prevPix->b + curPix->b + nextPix->b) / 3;
+    dstPix->a = 255;
+    prevPix++;
+    curPix++;
+    nextPix++;
+    dstPix++;
+  }
+}
+
+// The recursive mode keeps a running average of the rgb, as 3 floats per pixel,
+// so that small blends don't get rounded away.
+
+/* Start a running average off at count pixels */
+template <class PIX>
+inline void resetAccumulatorRow(const PIX *curPix, float *acc, int count)
+{
+  for(int i = 0; i < count; i++) {
+    acc[0] = curPix->r;
+    acc[1] = curPix->g;
+    acc[2] = curPix->b;
+    curPix++;
+    acc += 3;
+  }
+}
+
+/* Blend count pixels into a running average. weight (0->1) is how much of the new pixel goes in */
+template <class PIX>
+inline void blendAccumulatorRow(const PIX *curPix, float *acc, int count, float weight)
+{
+  for(int i = 0; i < count; i++) {
+    acc[0] += weight * (curPix->r - acc[0]);
+    acc[1] += weight * (curPix->g - acc[1]);
+    acc[2] += weight * (curPix->b - acc[2]);
+    curPix++;
+    acc += 3;
+  }
+}
+
+/* Write count pixels of a running average out. It's always a blend of 8 bit values, so just round */
+template <class PIX>
+inline void accumulatorRow(const float *acc, PIX *dstPix, int count)
+{
+  for(int i = 0; i < count; i++) {
+    dstPix->r = (unsigned char) (acc[0] + 0.5f);
+    dstPix->g = (unsigned char) (acc[1] + 0.5f);
+    dstPix->b = (unsigned char) (acc[2] + 0.5f);
+    dstPix->a = 255;
+    acc += 3;
+    dstPix++;
+  }
+}
@@ -0,0 +1,165 @@
+#pragma once
+
+// Scene cut detection for the temporal average. Each frame gets a small
+// signature: a histogram and an 8x8 grid of block means of its luma, taken
+// from every kSignatureColumnStep'th pixel of every kSignatureRowStep'th row. Two frames either side of a cut have
+// very different signatures, where neighbouring frames of the same shot
+// don't. Like averaging.h, this doesn't depend on OFX.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define kSignatureHistogramBins 32
+#define kSignatureBlocks 8
+#define kSignatureRowStep 32
+// A 1920x1080 frame still gets about 8000 samples, which is plenty for 32 bins and 64 blocks,
+// and keeps the signature well under 1% of the cost of averaging the frame
+#define kSignatureColumnStep 8
+
+// A cut needs both the overall luma distribution and the picture layout to change this much (0->1)
+#define kCutHistogramThreshold 0.3f
+#define kCutBlockThreshold 0.08f
+
+struct FrameSignature
+{
+  uint32_t histogram[kSignatureHistogramBins];
+  float blockMeans[kSignatureBlocks * kSignatureBlocks];
+};
+
+// Rec. 709 luma weights, out of 256
+#define kLumaR 54
+#define kLumaG 183
+#define kLumaB 19
+
+/* Luma (0->255) of count rgba pixels, kSignatureColumnStep pixels apart. Scalar version */
+inline void rowLumaScalar(const unsigned char *pix, int count, uint32_t *luma)
+{
+  for(int i = 0; i < count; i++) {
+    luma[i] = (kLumaR * pix[0] + kLumaG * pix[1] + kLumaB * pix[2]) >> 8;
+    pix += 4 * kSignatureColumnStep;
+  }
+}
+
+#ifdef __SSE2__
+/* rowLumaScalar(), four at a time */
+inline void rowLumaSSE2(const unsigned char *pix, int count, uint32_t *luma)
+{
+  const __m128i weights = _mm_setr_epi16(kLumaR, kLumaG, kLumaB, 0, kLumaR, kLumaG, kLumaB, 0);
+  const __m128i zero = _mm_setzero_si128();
+  const ptrdiff_t step = 4 * kSignatureColumnStep;
+  int i = 0;
+  for(; i + 4 <= count; i += 4) {
+    // Gather the four pixels into one register
+    const unsigned char *p = pix + step * i;
+    int32_t gathered[4];
+    memcpy(&gathered[0], p, 4);
+    memcpy(&gathered[1], p + step, 4);
+    memcpy(&gathered[2], p + 2 * step, 4);
+    memcpy(&gathered[3], p + 3 * step, 4);
+    __m128i rgba = _mm_loadu_si128(reinterpret_cast<const __m128i *>(gathered));
+    // r*wr + g*wg and b*wb + 0 for each pixel, then add those pairs together
+    __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(rgba, zero), weights);
+    __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(rgba, zero), weights);
+    __m128 even = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 odd = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(3, 1, 3, 1));
+    __m128i sum = _mm_add_epi32(_mm_castps_si128(even), _mm_castps_si128(odd));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(luma + i), _mm_srli_epi32(sum, 8));
+  }
+  rowLumaScalar(pix + step * i, count - i, luma + i);
+}
+#endif
+
+inline void rowLuma(const unsigned char *pix, int count, uint32_t *luma)
+{
+#ifdef __SSE2__
+  rowLumaSSE2(pix, count, luma);
+#else
+  rowLumaScalar(pix, count, luma);
+#endif
+}
+
+/* Work out the signature of an 8 bit rgba image. lumaRow is scratch space for width values.
+   ROWLUMA gets the luma of every kSignatureColumnStep'th pixel of a row */
+template <void (*ROWLUMA)(const unsigned char *, int, uint32_t *)>
+inline void computeSignature(const unsigned char *data, int width, int height, int rowBytes,
+                             uint32_t *lumaRow, FrameSignature *signature)
+{
+  uint64_t blockSums[kSignatureBlocks * kSignatureBlocks];
+  uint32_t blockCounts[kSignatureBlocks * kSignatureBlocks];
+  memset(signature->histogram, 0, sizeof(signature->histogram));
+  memset(blockSums, 0, sizeof(blockSums));
+  memset(blockCounts, 0, sizeof(blockCounts));
+
+  // The samples of each row are centred in their kSignatureColumnStep pixels, like the rows are
+  const int firstColumn = kSignatureColumnStep / 2;
+  const int samples = width > firstColumn ? (width - firstColumn + kSignatureColumnStep - 1) / kSignatureColumnStep : 0;
+
+  for(int y = kSignatureRowStep / 2; y < height; y += kSignatureRowStep) {
+    ROWLUMA(data + (ptrdiff_t) y * rowBytes + 4 * firstColumn, samples, lumaRow);
+    const int blockRow = y * kSignatureBlocks / height;
+
+    for(int bx = 0; bx < kSignatureBlocks; bx++) {
+      const int x1 = bx * samples / kSignatureBlocks;
+      const int x2 = (bx + 1) * samples / kSignatureBlocks;
+      uint64_t sum = 0;
+      for(int x = x1; x < x2; x++) {
+        sum += lumaRow[x];
+        signature->histogram[lumaRow[x] * kSignatureHistogramBins / 256]++;
+      }
+      blockSums[blockRow * kSignatureBlocks + bx] += sum;
+      blockCounts[blockRow * kSignatureBlocks + bx] += x2 - x1;
+    }
+  }
+
+  for(int i = 0; i < kSignatureBlocks * kSignatureBlocks; i++) {
+    // Small frames can leave some blocks without any samples. They're marked so they don't count
+    signature->blockMeans[i] = blockCounts[i] ? float(blockSums[i]) / blockCounts[i] : -1.0f;
+  }
+}
+
+inline void computeSignature(const unsigned char *data, int width, int height, int rowBytes,
+                             uint32_t *lumaRow, FrameSignature *signature)
+{
+  computeSignature<rowLuma>(data, width, height, rowBytes, lumaRow, signature);
+}
+
+/* Whether there's a cut between the frames with these signatures */
+inline bool isSceneCut(const FrameSignature &a, const FrameSignature &b)
+{
+  uint32_t countA = 0, countB = 0;
+  for(int i = 0; i < kSignatureHistogramBins; i++) {
+    countA += a.histogram[i];
+    countB += b.histogram[i];
+  }
+  if(!countA || !countB)
+    return false;
+
+  // Half the L1 distance between the normalised histograms, 0->1
+  float histogramDistance = 0.0f;
+  for(int i = 0; i < kSignatureHistogramBins; i++) {
+    const float d = float(a.histogram[i]) / countA - float(b.histogram[i]) / countB;
+    histogramDistance += d < 0.0f ? -d : d;
+  }
+  histogramDistance *= 0.5f;
+
+  // Mean absolute difference of the block means that were sampled in both, 0->1
+  float blockDistance = 0.0f;
+  int blocks = 0;
+  for(int i = 0; i < kSignatureBlocks * kSignatureBlocks; i++) {
+    if(a.blockMeans[i] < 0.0f || b.blockMeans[i] < 0.0f)
+      continue;
+    const float d = a.blockMeans[i] - b.blockMeans[i];
+    blockDistance += d < 0.0f ? -d : d;
+    blocks++;
+  }
+  if(!blocks)
+    return false;
+  blockDistance /= 255.0f * blocks;
+
+  return histogramDistance > kCutHistogramThreshold && blockDistance > kCutBlockThreshold;
+}
@@ -1,17 +1,26 @@
+#include <math.h>
 #include <string.h>
+#include <algorithm>
+#include <map>
+#include <vector>
 #include "ofxImageEffect.h"
 #include "ofxMemory.h"
 #include "ofxMultiThread.h"
+#include "ofxParam.h"
 #include "ofxPixels.h"
+#include "averaging.h"
+#include "scenecut.h"
 
 OfxHost               *gHost;
 OfxImageEffectSuiteV1 *gEffectHost = 0;
 OfxPropertySuiteV1    *gPropHost = 0;
+OfxParameterSuiteV1   *gParamHost = 0;
+OfxMultiThreadSuiteV1 *gThreadHost = 0;
 
 inline OfxRGBAColourB *
 pixelAddress(OfxRGBAColourB *img, OfxRectI rect, int x, int y, int bytesPerLine)
 {  
-  if(x < rect.x1 || x >= rect.x2 || y < rect.y1 || y > rect.y2)
+  if(x < rect.x1 || x >= rect.x2 || y < rect.y1 || y >= rect.y2)
     return 0;
   OfxRGBAColourB *pix = (OfxRGBAColourB *) (((char *) img) + (y - rect.y1) * bytesPerLine);
   pix += x - rect.x1;  
@@ -20,6 +29,217 @@ pixelAddress(OfxRGBAColourB *img, OfxRectI rect, int x, int y, int bytesPerLine)
 
 class NoImageEx {};
 
+// How many source frame signatures to remember
+#define kMaxSignatures 64
+
+#define kModeParamName "mode"
+#define kStrengthParamName "strength"
+
+// Window averages each frame with its neighbours. Recursive blends each frame
+// into a running average of the ones before it, which only needs the one
+// source frame per output frame when the host renders in order.
+#define kModeWindow 0
+#define kModeRecursive 1
+
+// When recursive mode can't carry on from the last frame it rendered, it starts
+// again this many frames back at most. That's exact to within an 8 bit level for
+// strengths up to about 0.68, and a bit lighter on the past above that.
+#define kMaxPrimeFrames 16
+
+// Per-instance state. Renders aren't declared thread safe, so the host won't
+// render more than one frame at a time with an instance, but with host frame
+// threading it renders bands of rows of that frame at once. Anything that works
+// on the whole frame, and the signatures, are behind the mutex.
+struct InstanceData {
+  InstanceData()
+    : modeParam(0), strengthParam(0), mutex(0), previousValid(false),
+      accumulatorTime(0), accumulatorStrength(0), accumulatorReset(false), accumulatorValid(false) {}
+
+  OfxParamHandle modeParam;
+  OfxParamHandle strengthParam;
+  OfxMutexHandle mutex;
+
+  // Signatures of source frames, for spotting cuts, keyed on time
+  std::map<OfxTime, FrameSignature> signatures;
+  std::vector<uint32_t> lumaRow;
+
+  // Recursive mode's running average of the whole source frame, 3 floats per
+  // pixel of previousRect, up to the frame before accumulatorTime. Not valid if
+  // accumulatorTime starts the running average off.
+  std::vector<float> previous;
+  OfxRectI previousRect;
+  // The signature of the last frame blended in, for spotting a cut before the next
+  FrameSignature previousSignature;
+  bool previousValid;
+
+  // The running average at accumulatorTime, 3 floats per pixel of accumulatorRect.
+  // Each render blends the rows of its render window into it from previous, so a
+  // re-render blends in the source as it is now, and rowBlended says which rows are done
+  std::vector<float> accumulator;
+  std::vector<char> rowBlended;
+  OfxRectI accumulatorRect;
+  OfxTime accumulatorTime;
+  // The strength and source signature at accumulatorTime
+  double accumulatorStrength;
+  FrameSignature accumulatorSignature;
+  // Whether accumulatorTime starts the running average off, rather than blending into previous
+  bool accumulatorReset;
+  bool accumulatorValid;
+};
+
+// Holds an instance's mutex until it goes out of scope
+class MutexLock {
+public:
+  MutexLock(OfxMutexHandle mutex) : mutex(mutex) { gThreadHost->mutexLock(mutex); }
+  ~MutexLock() { gThreadHost->mutexUnLock(mutex); }
+private:
+  OfxMutexHandle mutex;
+};
+
+static InstanceData *
+getInstanceData(OfxImageEffectHandle instance)
+{
+  OfxPropertySetHandle effectProps;
+  gEffectHost->getPropertySet(instance, &effectProps);
+  void *data = 0;
+  gPropHost->propGetPointer(effectProps, kOfxPropInstanceData, 0, &data);
+  return (InstanceData *) data;
+}
+
+static OfxStatus
+createInstance(OfxImageEffectHandle instance)
+{
+  OfxPropertySetHandle effectProps;
+  gEffectHost->getPropertySet(instance, &effectProps);
+
+  InstanceData *data = new InstanceData;
+  OfxParamSetHandle paramSet;
+  gEffectHost->getParamSet(instance, &paramSet);
+  gParamHost->paramGetHandle(paramSet, kModeParamName, &data->modeParam, 0);
+  gParamHost->paramGetHandle(paramSet, kStrengthParamName, &data->strengthParam, 0);
+  gThreadHost->mutexCreate(&data->mutex, 0);
+
+  gPropHost->propSetPointer(effectProps, kOfxPropInstanceData, 0, (void *) data);
+  return kOfxStatOK;
+}
+
+static OfxStatus
+destroyInstance(OfxImageEffectHandle instance)
+{
+  InstanceData *data = getInstanceData(instance);
+  if(data) {
+    gThreadHost->mutexDestroy(data->mutex);
+    delete data;
+  }
+  return kOfxStatOK;
+}
+
+static OfxStatus
+purgeCaches(OfxImageEffectHandle instance)
+{
+  InstanceData *data = getInstanceData(instance);
+  if(data) {
+    MutexLock lock(data->mutex);
+    data->signatures.clear();
+    data->accumulatorValid = false;
+    data->previousValid = false;
+    std::vector<float>().swap(data->accumulator);
+    std::vector<float>().swap(data->previous);
+    std::vector<char>().swap(data->rowBlended);
+  }
+  return kOfxStatOK;
+}
+
+// Get the signature of a source frame, working it out if we haven't already.
+// Needs the instance's mutex
+static FrameSignature
+getSignature(InstanceData *data, OfxTime time, OfxPropertySetHandle img)
+{
+  std::map<OfxTime, FrameSignature>::const_iterator it = data->signatures.find(time);
+  if(it != data->signatures.end())
+    return it->second;
+
+  int rowBytes;
+  OfxRectI rect;
+  void *ptr;
+  gPropHost->propGetInt(img, kOfxImagePropRowBytes, 0, &rowBytes);
+  gPropHost->propGetIntN(img, kOfxImagePropBounds, 4, &rect.x1);
+  gPropHost->propGetPointer(img, kOfxImagePropData, 0, &ptr);
+
+  const int width = rect.x2 > rect.x1 ? rect.x2 - rect.x1 : 0;
+  const int height = rect.y2 > rect.y1 ? rect.y2 - rect.y1 : 0;
+  data->lumaRow.resize(width);
+  FrameSignature signature;
+  computeSignature((const unsigned char *) ptr, width, height, rowBytes, data->lumaRow.data(), &signature);
+
+  // forget whichever signature is furthest away in time
+  if(data->signatures.size() >= kMaxSignatures) {
+    std::map<OfxTime, FrameSignature>::iterator first = data->signatures.begin();
+    std::map<OfxTime, FrameSignature>::iterator last = --data->signatures.end();
+    data->signatures.erase(time - first->first > last->first - time ? first : last);
+  }
+  data->signatures[time] = signature;
+  return signature;
+}
+
+static int
+getMode(InstanceData *data, OfxTime time)
+{
+  int mode = kModeWindow;
+  if(data && data->modeParam)
+    gParamHost->paramGetValueAtTime(data->modeParam, time, &mode);
+  return mode;
+}
+
+static double
+getStrength(InstanceData *data, OfxTime time)
+{
+  double strength = 0;
+  if(data && data->strengthParam)
+    gParamHost->paramGetValueAtTime(data->strengthParam, time, &strength);
+  return strength;
+}
+
+// How many frames back recursive mode needs to start from, for the oldest one's
+// weight in the running average to be under half an 8 bit level
+static int
+primeFrameCount(double strength)
+{
+  if(strength <= 0)
+    return 0;
+  if(strength >= 1)
+    return kMaxPrimeFrames;
+  const int frames = (int) ceil(log(1.0 / 512) / log(strength));
+  return frames < kMaxPrimeFrames ? frames : kMaxPrimeFrames;
+}
+
+// Whether the running average can carry on to time, from this frame or the one before it.
+// It doesn't matter whether the host calls it a sequential render: interactive playback
+// comes in order too, without saying so. Each frame is blended in with its own strength,
+// so an animated strength is fine, but if it's changed at the frame the running average
+// is at, the earlier frames may well have changed too. The one before has to have had
+// all of its rows rendered. Needs the instance's mutex
+static bool
+canCarryOn(const InstanceData *data, OfxTime time, double strength)
+{
+  if(!data || !data->accumulatorValid)
+    return false;
+  if(data->accumulatorTime == time)
+    return data->accumulatorStrength == strength;
+  return data->accumulatorTime == time - 1 &&
+         std::find(data->rowBlended.begin(), data->rowBlended.end(), 0) == data->rowBlended.end();
+}
+
+// The source clip's first and last frames
+static void
+getSourceFrameRange(OfxImageEffectHandle instance, double *range)
+{
+  OfxImageClipHandle sourceClip;
+  OfxPropertySetHandle clipProps;
+  gEffectHost->clipGetHandle(instance, "Source", &sourceClip, &clipProps);
+  gPropHost->propGetDoubleN(clipProps, kOfxImageEffectPropFrameRange, 2, range);
+}
+
 static OfxStatus getFramesNeeded(OfxImageEffectHandle instance,
                                  OfxPropertySetHandle inArgs,
                                  OfxPropertySetHandle outArgs)
@@ -27,6 +247,27 @@ static OfxStatus getFramesNeeded(OfxImageEffectHandle instance,
     OfxTime time;
     double rangeSource[4];
     gPropHost->propGetDouble(inArgs, kOfxPropTime, 0, &time);
+
+    // Recursive mode only fetches the current frame when it's carrying on from the last
+    // one, but if the host has jumped it goes back to prime its running average. Should
+    // that change before the render, it does without any frames it can't fetch
+    InstanceData *data = getInstanceData(instance);
+    if(getMode(data, time) == kModeRecursive) {
+      const double strength = getStrength(data, time);
+      double frameRange[2];
+      getSourceFrameRange(instance, frameRange);
+      bool carryOn;
+      {
+        MutexLock lock(data->mutex);
+        carryOn = canCarryOn(data, time, strength);
+      }
+      const OfxTime start = carryOn ? time : time - primeFrameCount(strength);
+      rangeSource[0] = start > frameRange[0] ? start : frameRange[0];
+      rangeSource[1] = time;
+      gPropHost->propSetDoubleN(outArgs, "OfxImageClipPropFrameRange_Source", 2, rangeSource);
+      return kOfxStatOK;
+    }
+
     rangeSource[0] = 1;  // Just because the range apparently needs an even number of elements
     rangeSource[1] = time > 1 ? time - 1 : time;
     rangeSource[2] = time;
@@ -36,6 +277,221 @@ static OfxStatus getFramesNeeded(OfxImageEffectHandle instance,
     return kOfxStatOK;
 }
 
+// Blend a whole source frame into the running average in previous, when priming it. It
+// starts again from this frame if there isn't one yet, after a cut, or if the frame isn't
+// the same size as the last.
+static void
+accumulate(InstanceData *data, OfxTime time, OfxPropertySetHandle img, float weight)
+{
+  int rowBytes;
+  OfxRectI rect;
+  void *ptr;
+  gPropHost->propGetInt(img, kOfxImagePropRowBytes, 0, &rowBytes);
+  gPropHost->propGetIntN(img, kOfxImagePropBounds, 4, &rect.x1);
+  gPropHost->propGetPointer(img, kOfxImagePropData, 0, &ptr);
+
+  const FrameSignature signature = getSignature(data, time, img);
+  const bool reset = !data->previousValid ||
+                     rect.x1 != data->previousRect.x1 || rect.y1 != data->previousRect.y1 ||
+                     rect.x2 != data->previousRect.x2 || rect.y2 != data->previousRect.y2 ||
+                     isSceneCut(data->previousSignature, signature);
+  data->previousSignature = signature;
+
+  const int width = rect.x2 > rect.x1 ? rect.x2 - rect.x1 : 0;
+  const int height = rect.y2 > rect.y1 ? rect.y2 - rect.y1 : 0;
+  if(reset) {
+    data->previousRect = rect;
+    data->previous.resize((size_t) width * height * 3);
+  }
+
+  for(int y = 0; y < height; y++) {
+    const OfxRGBAColourB *pix = (const OfxRGBAColourB *) (((const char *) ptr) + y * rowBytes);
+    float *acc = &data->previous[(size_t) y * width * 3];
+    if(reset)
+      resetAccumulatorRow(pix, acc, width);
+    else
+      blendAccumulatorRow(pix, acc, width, weight);
+  }
+  data->previousValid = true;
+}
+
+// Get the running average ready for the rows of a frame to be blended in, from previous
+static void
+startFrame(InstanceData *data, OfxTime time, OfxPropertySetHandle img, double strength)
+{
+  OfxRectI rect;
+  gPropHost->propGetIntN(img, kOfxImagePropBounds, 4, &rect.x1);
+
+  const FrameSignature signature = getSignature(data, time, img);
+  data->accumulatorReset = !data->previousValid ||
+                           rect.x1 != data->previousRect.x1 || rect.y1 != data->previousRect.y1 ||
+                           rect.x2 != data->previousRect.x2 || rect.y2 != data->previousRect.y2 ||
+                           isSceneCut(data->previousSignature, signature);
+
+  const int width = rect.x2 > rect.x1 ? rect.x2 - rect.x1 : 0;
+  const int height = rect.y2 > rect.y1 ? rect.y2 - rect.y1 : 0;
+  data->accumulator.resize((size_t) width * height * 3);
+  data->rowBlended.assign(height, 0);
+  data->accumulatorRect = rect;
+  data->accumulatorTime = time;
+  data->accumulatorStrength = strength;
+  data->accumulatorSignature = signature;
+  data->accumulatorValid = true;
+}
+
+// Recursive mode. The running average covers the whole source frame, whatever the
+// render window, so it can carry on to the next frame.
+static OfxStatus
+renderRecursive(OfxImageEffectHandle instance, InstanceData *data,
+                OfxTime time, OfxRectI renderWindow)
+{
+  OfxStatus status = kOfxStatOK;
+  OfxPropertySetHandle currentImg = NULL, outputImg = NULL;
+
+  const double strength = getStrength(data, time);
+  const float weight = (float) (1 - strength);
+
+  OfxImageClipHandle sourceClip, outputClip;
+  gEffectHost->clipGetHandle(instance, "Source", &sourceClip, 0);
+  gEffectHost->clipGetHandle(instance, "Output", &outputClip, 0);
+
+  try {
+    if(gEffectHost->clipGetImage(outputClip, time, NULL, &outputImg) != kOfxStatOK) {
+      throw NoImageEx();
+    }
+    if(gEffectHost->clipGetImage(sourceClip, time, NULL, &currentImg) != kOfxStatOK) {
+      throw NoImageEx();
+    }
+
+    // The whole frame part: catching the running average up to the frame before this one,
+    // and deciding whether to blend into it. The rows get blended in below, in parallel
+    // with any other bands of this frame
+    bool reset;
+    OfxRectI accRect;
+    float *accumulator;
+    const float *previous;
+    char *rowBlended;
+    {
+      MutexLock lock(data->mutex);
+      OfxRectI srcRect;
+      gPropHost->propGetIntN(currentImg, kOfxImagePropBounds, 4, &srcRect.x1);
+
+      const bool carryOn = canCarryOn(data, time, strength);
+      if(carryOn && data->accumulatorTime == time) {
+        // Another band of this frame, or a re-render of it, which blends its rows in again.
+        // Only a change upstream could change the frame's size
+        const OfxRectI &rect = data->accumulatorRect;
+        if(srcRect.x1 != rect.x1 || srcRect.y1 != rect.y1 || srcRect.x2 != rect.x2 || srcRect.y2 != rect.y2)
+          startFrame(data, time, currentImg, strength);
+      }
+      else if(carryOn) {
+        // The next frame along: one fetch, and the last frame's running average becomes previous
+        data->previous.swap(data->accumulator);
+        data->previousRect = data->accumulatorRect;
+        data->previousSignature = data->accumulatorSignature;
+        data->previousValid = true;
+        startFrame(data, time, currentImg, strength);
+      }
+      else {
+        // The host has jumped, so start again a few frames back, as if we'd been going all along
+        data->accumulatorValid = false;
+        data->previousValid = false;
+        double frameRange[2];
+        getSourceFrameRange(instance, frameRange);
+        OfxTime start = time - primeFrameCount(strength);
+        start = start > frameRange[0] ? start : frameRange[0];
+
+        for(OfxTime t = start; t < time; t++) {
+          if(gEffectHost->abort(instance))
+            throw NoImageEx();
+          OfxPropertySetHandle img;
+          if(gEffectHost->clipGetImage(sourceClip, t, NULL, &img) != kOfxStatOK)
+            continue;
+          accumulate(data, t, img, (float) (1 - getStrength(data, t)));
+          gEffectHost->clipReleaseImage(img);
+        }
+        startFrame(data, time, currentImg, strength);
+      }
+
+      reset = data->accumulatorReset;
+      accRect = data->accumulatorRect;
+      accumulator = data->accumulator.data();
+      previous = data->previous.data();
+      rowBlended = data->rowBlended.data();
+    }
+
+    int srcRowBytes;
+    void *srcPtr;
+    gPropHost->propGetInt(currentImg, kOfxImagePropRowBytes, 0, &srcRowBytes);
+    gPropHost->propGetPointer(currentImg, kOfxImagePropData, 0, &srcPtr);
+
+    int dstRowBytes;
+    OfxRectI dstRect;
+    void *dstPtr;
+    gPropHost->propGetInt(outputImg, kOfxImagePropRowBytes, 0, &dstRowBytes);
+    gPropHost->propGetIntN(outputImg, kOfxImagePropBounds, 4, &dstRect.x1);
+    gPropHost->propGetPointer(outputImg, kOfxImagePropData, 0, &dstPtr);
+    OfxRGBAColourB *dst = (OfxRGBAColourB *) dstPtr;
+
+    const int accWidth = accRect.x2 - accRect.x1;
+
+    for(int y = renderWindow.y1; y < renderWindow.y2; y++) {
+      if(gEffectHost->abort(instance)) break;
+
+      OfxRGBAColourB *dstPix = pixelAddress(dst, dstRect, renderWindow.x1, y, dstRowBytes);
+      const bool rowInside = y >= accRect.y1 && y < accRect.y2;
+
+      // Blend the whole row in, so it's ready for the next frame to carry on from. Host frame
+      // threading slices frames into bands of rows, so no other render is blending this one
+      if(rowInside) {
+        const size_t offset = (size_t) (y - accRect.y1) * accWidth * 3;
+        const OfxRGBAColourB *srcPix = (const OfxRGBAColourB *) (((const char *) srcPtr) + (ptrdiff_t) (y - accRect.y1) * srcRowBytes);
+        if(reset) {
+          resetAccumulatorRow(srcPix, accumulator + offset, accWidth);
+        }
+        else {
+          memcpy(accumulator + offset, previous + offset, accWidth * 3 * sizeof(float));
+          blendAccumulatorRow(srcPix, accumulator + offset, accWidth, weight);
+        }
+        rowBlended[y - accRect.y1] = 1;
+      }
+
+      // if both ends of the row are in the source frame, so is everything in between
+      if(rowInside && renderWindow.x1 >= accRect.x1 && renderWindow.x2 <= accRect.x2) {
+        accumulatorRow(&accumulator[((size_t) (y - accRect.y1) * accWidth + (renderWindow.x1 - accRect.x1)) * 3],
+                       dstPix, renderWindow.x2 - renderWindow.x1);
+        continue;
+      }
+
+      for(int x = renderWindow.x1; x < renderWindow.x2; x++) {
+        if(rowInside && x >= accRect.x1 && x < accRect.x2) {
+          accumulatorRow(&accumulator[((size_t) (y - accRect.y1) * accWidth + (x - accRect.x1)) * 3], dstPix, 1);
+        }
+        else {
+          dstPix->r = 0;
+          dstPix->g = 0;
+          dstPix->b = 0;
+          dstPix->a = 0;
+        }
+        dstPix++;
+      }
+    }
+  }
+  catch(NoImageEx &) {
+    // if we were interrupted, the failed fetch is fine, just return kOfxStatOK
+    // otherwise, something wierd happened
+    if(!gEffectHost->abort(instance)) {
+      status = kOfxStatFailed;
+    }
+  }
+
+  if(currentImg)
+    gEffectHost->clipReleaseImage(currentImg);
+  if(outputImg)
+    gEffectHost->clipReleaseImage(outputImg);
+
+  return status;
+}
 
 static OfxStatus render(OfxImageEffectHandle  instance,
                         OfxPropertySetHandle inArgs,
@@ -44,10 +500,14 @@ static OfxStatus render(OfxImageEffectHandle  instance,
   OfxTime time;
   OfxRectI renderWindow;
   OfxStatus status = kOfxStatOK;
+  InstanceData *data = getInstanceData(instance);
   
   gPropHost->propGetDouble(inArgs, kOfxPropTime, 0, &time);
   gPropHost->propGetIntN(inArgs, kOfxImageEffectPropRenderWindow, 4, &renderWindow.x1);
 
+  if(data && getMode(data, time) == kModeRecursive)
+    return renderRecursive(instance, data, time, renderWindow);
+
   OfxImageClipHandle outputClip;
   gEffectHost->clipGetHandle(instance, "Output", &outputClip, 0);
     
@@ -55,7 +515,6 @@ static OfxStatus render(OfxImageEffectHandle  instance,
   OfxPropertySetHandle currentImg = NULL, prevImg = NULL, nextImg = NULL, outputImg = NULL;
 
   try {
-    OfxPropertySetHandle outputImg;
     if(gEffectHost->clipGetImage(outputClip, time, NULL, &outputImg) != kOfxStatOK) {
       throw NoImageEx();
     }
@@ -71,11 +530,14 @@ static OfxStatus render(OfxImageEffectHandle  instance,
     OfxImageClipHandle sourceClip;
     gEffectHost->clipGetHandle(instance, "Source", &sourceClip, 0);
       
-    if(gEffectHost->clipGetImage(sourceClip, time > 1 ? (time - 1) : time, NULL, &prevImg) != kOfxStatOK) {
+    OfxTime prevTime = time > 1 ? (time - 1) : time;
+    OfxTime nextTime = time < 50 ? (time + 1) : time;
+
+    if(gEffectHost->clipGetImage(sourceClip, prevTime, NULL, &prevImg) != kOfxStatOK) {
       throw NoImageEx();
     }
     
-    if(gEffectHost->clipGetImage(sourceClip, time < 50 ? (time + 1) : time, NULL, &nextImg) != kOfxStatOK) {
+    if(gEffectHost->clipGetImage(sourceClip, nextTime, NULL, &nextImg) != kOfxStatOK) {
       throw NoImageEx();
     }
 
@@ -98,11 +560,32 @@ static OfxStatus render(OfxImageEffectHandle  instance,
     OfxRGBAColourB *next = (OfxRGBAColourB *) nextPtr;
     OfxRGBAColourB *dst = (OfxRGBAColourB *) dstPtr;
 
+    // Don't average across a cut. The frame on the other side of it gets
+    // treated like the ends of the clip are, and replaced with the current one.
+    if(data) {
+      MutexLock lock(data->mutex);
+      const FrameSignature curSignature = getSignature(data, time, currentImg);
+      if(prevTime != time && isSceneCut(getSignature(data, prevTime, prevImg), curSignature))
+        prev = cur;
+      if(nextTime != time && isSceneCut(curSignature, getSignature(data, nextTime, nextImg)))
+        next = cur;
+    }
+
     for(int y = renderWindow.y1; y < renderWindow.y2; y++) {
       if(gEffectHost->abort(instance)) break;
 
       OfxRGBAColourB *dstPix = pixelAddress(dst, dstRect, renderWindow.x1, y, dstRowBytes);
 
+      // if both ends of the row are in the source images, so is everything in between
+      if(pixelAddress(cur, srcRect, renderWindow.x1, y, srcRowBytes) &&
+         pixelAddress(cur, srcRect, renderWindow.x2 - 1, y, srcRowBytes)) {
+        averageRow(pixelAddress(prev, srcRect, renderWindow.x1, y, srcRowBytes),
+                   pixelAddress(cur, srcRect, renderWindow.x1, y, srcRowBytes),
+                   pixelAddress(next, srcRect, renderWindow.x1, y, srcRowBytes),
+                   dstPix, renderWindow.x2 - renderWindow.x1);
+        continue;
+      }
+
       for(int x = renderWindow.x1; x < renderWindow.x2; x++) {
         
         OfxRGBAColourB *prevPix = pixelAddress(prev, srcRect, x, y, srcRowBytes);
@@ -110,10 +593,7 @@ static OfxStatus render(OfxImageEffectHandle  instance,
         OfxRGBAColourB *nextPix = pixelAddress(next, srcRect, x, y, srcRowBytes);
 
         if(curPix) {
-            dstPix->r = (prevPix->r + curPix->r + nextPix->r) / 3;
-            dstPix->g = (prevPix->g + curPix->g + nextPix->g) / 3;
-            dstPix->b = (prevPix->b + curPix->b + nextPix->b) / 3;
-            dstPix->a = 255;
+            averageRow(prevPix, curPix, nextPix, dstPix, 1);
         }
         else {
           dstPix->r = 0;
@@ -135,6 +615,8 @@ static OfxStatus render(OfxImageEffectHandle  instance,
 
   if(prevImg)
     gEffectHost->clipReleaseImage(prevImg);
+  if(nextImg)
+    gEffectHost->clipReleaseImage(nextImg);
   if(currentImg)
     gEffectHost->clipReleaseImage(currentImg);
   if(outputImg)
@@ -153,12 +635,35 @@ describeInContext( OfxImageEffectHandle  effect,  OfxPropertySetHandle inArgs)
 
   // set the component types we can handle on out output
   gPropHost->propSetString(props, kOfxImageEffectPropSupportedComponents, 0, kOfxImageComponentRGBA);
+  gPropHost->propSetInt(props, kOfxImageEffectPropSupportsTiles, 0, 0);
 
   // define the single source clip in both contexts
   gEffectHost->clipDefine(effect, "Source", &props);
 
   // set the component types we can handle on our main input
   gPropHost->propSetString(props, kOfxImageEffectPropSupportedComponents, 0, kOfxImageComponentRGBA);
+  gPropHost->propSetInt(props, kOfxImageEffectPropSupportsTiles, 0, 0);
+
+  OfxParamSetHandle paramSet;
+  gEffectHost->getParamSet(effect, &paramSet);
+
+  gParamHost->paramDefine(paramSet, kOfxParamTypeChoice, kModeParamName, &props);
+  gPropHost->propSetString(props, kOfxPropLabel, 0, "Mode");
+  gPropHost->propSetString(props, kOfxParamPropHint, 0,
+                           "Window averages each frame with the ones either side. Recursive blends each frame into a running average of the ones before it, which is much cheaper when rendering in order");
+  gPropHost->propSetString(props, kOfxParamPropChoiceOption, 0, "Window");
+  gPropHost->propSetString(props, kOfxParamPropChoiceOption, 1, "Recursive");
+  gPropHost->propSetInt(props, kOfxParamPropDefault, 0, kModeWindow);
+
+  gParamHost->paramDefine(paramSet, kOfxParamTypeDouble, kStrengthParamName, &props);
+  gPropHost->propSetString(props, kOfxPropLabel, 0, "Strength");
+  gPropHost->propSetString(props, kOfxParamPropHint, 0,
+                           "How much of the running average each frame keeps, in Recursive mode. Higher is smoother");
+  gPropHost->propSetDouble(props, kOfxParamPropDefault, 0, 0.5);
+  gPropHost->propSetDouble(props, kOfxParamPropMin, 0, 0);
+  gPropHost->propSetDouble(props, kOfxParamPropMax, 0, 0.95);
+  gPropHost->propSetDouble(props, kOfxParamPropDisplayMin, 0, 0);
+  gPropHost->propSetDouble(props, kOfxParamPropDisplayMax, 0, 0.95);
 
   return kOfxStatOK;
 }
@@ -186,6 +691,12 @@ describe(OfxImageEffectHandle effect)
   gPropHost->propSetString(effectProps, kOfxImageEffectPropSupportedContexts, 0, kOfxImageEffectContextFilter);
 
   gPropHost->propSetInt(effectProps, kOfxImageEffectPropTemporalClipAccess, 0, 1);
+
+  // Recursive mode is cheapest when frames come in order, but copes when they don't
+  gPropHost->propSetInt(effectProps, kOfxImageEffectInstancePropSequentialRender, 0, 2);
+  // The running average covers the whole source frame, and would be reset by each tile of
+  // a frame being a different size, so every image has to be the whole frame
+  gPropHost->propSetInt(effectProps, kOfxImageEffectPropSupportsTiles, 0, 0);
   
   return kOfxStatOK;
 }
@@ -200,7 +711,9 @@ onLoad(void)
     
     gEffectHost     = (OfxImageEffectSuiteV1 *) gHost->fetchSuite(gHost->host, kOfxImageEffectSuite, 1);
     gPropHost       = (OfxPropertySuiteV1 *)    gHost->fetchSuite(gHost->host, kOfxPropertySuite, 1);
-    if(!gEffectHost || !gPropHost)
+    gParamHost      = (OfxParameterSuiteV1 *)   gHost->fetchSuite(gHost->host, kOfxParameterSuite, 1);
+    gThreadHost     = (OfxMultiThreadSuiteV1 *) gHost->fetchSuite(gHost->host, kOfxMultiThreadSuite, 1);
+    if(!gEffectHost || !gPropHost || !gParamHost || !gThreadHost)
         return kOfxStatErrMissingHostFeature;
     return kOfxStatOK;
 }
@@ -219,6 +732,15 @@ pluginMain(const char *action,  const void *handle, OfxPropertySetHandle inArgs,
   else if(strcmp(action, kOfxActionDescribe) == 0) {
     return describe(effect);
   }
+  else if(strcmp(action, kOfxActionCreateInstance) == 0) {
+    return createInstance(effect);
+  }
+  else if(strcmp(action, kOfxActionDestroyInstance) == 0) {
+    return destroyInstance(effect);
+  }
+  else if(strcmp(action, kOfxActionPurgeCaches) == 0) {
+    return purgeCaches(effect);
+  }
   else if(strcmp(action, kOfxImageEffectActionDescribeInContext) == 0) {
     return describeInContext(effect, inArgs);
   }
@@ -0,0 +1,366 @@
+// Microbenchmarks for the per-pixel kernels of the plugins, so that a
+// performance change can be pinned on a particular function rather than
+// just showing up in end-to-end render times.
+//
+// Each kernel is run single threaded over a buffer of pixels from a few
+// input distributions. Times are always reported; cycles, IPC and cache
+// misses are reported too if perf_event_open lets us count them.
+//
+// Usage: kernelbench [pixels] [repeats]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <vector>
+
+#include "perfcounters.h"
+#include "hslqualifier.h"
+#include "libqualiflower.h"
+#include "averaging.h"
+#include "scenecut.h"
+
+using namespace qualiflower;
+
+struct RGBA8
+{
+    unsigned char r, g, b, a;
+};
+
+enum Distribution { eGreys, eSaturated, eHDR, eNegativeBlacks, eNumDistributions };
+static const char* kDistributionNames[eNumDistributions] = { "greys", "saturated", "hdr", "nan-blacks" };
+
+/** @brief Inputs and outputs for the kernels, all count pixels long */
+struct BenchData
+{
+    size_t count;
+    std::vector<float> rgba;    // float rgba source
+    std::vector<float> hsl;     // rgb2hsl of the source, 4 floats per pixel
+    std::vector<float> out;     // 4 floats per pixel of output
+    std::vector<RGBA8> frames[3];
+    std::vector<RGBA8> out8;
+    std::vector<float> accumulator;   // 3 floats per pixel
+    std::vector<uint32_t> lumaRow;
+    std::vector<uint32_t> whitePointBins;
+    std::vector<float> mask;    // 1 float per pixel, an ellipse in the middle of the frame
+    MaskOccupancy occupancy;    // of mask, for processWindow()
+    QualifierParams params;
+};
+
+// Something for the kernels to write to, so their results can't be optimised away
+static volatile float g_Sink;
+
+////////////////////////////////////////////////////////////////////////////////
+// Inputs
+
+static unsigned int g_Seed = 1;
+
+static float random01()
+{
+    // Deterministic, so runs are comparable
+    g_Seed = g_Seed * 1664525u + 1013904223u;
+    return (g_Seed >> 8) * (1.0f / 16777216.0f);
+}
+
+static void fillPixels(BenchData& p_Data, Distribution p_Distribution)
+{
+    g_Seed = 1;
+    for (size_t i = 0; i < p_Data.count; i++) {
+        float* pix = &p_Data.rgba[i * 4];
+        switch (p_Distribution) {
+        case eGreys:
+            pix[0] = pix[1] = pix[2] = random01();
+            break;
+        case eSaturated: {
+            // One strong channel, the others weak
+            const int strong = static_cast<int>(random01() * 3) % 3;
+            for (int c = 0; c < 3; c++) pix[c] = c == strong ? 0.5f + 0.5f * random01() : 0.1f * random01();
+            break;
+        }
+        case eHDR:
+            for (int c = 0; c < 3; c++) pix[c] = 8.0f * random01();
+            break;
+        case eNegativeBlacks:
+            // max == 0 with a non-zero delta, which is the path where rgb2hsl gives a NaN hue
+            pix[0] = 0.0f;
+            pix[1] = -0.5f * random01() - 0.001f;
+            pix[2] = -0.5f * random01() - 0.001f;
+            break;
+        default:
+            break;
+        }
+        pix[3] = 1.0f;
+
+        float h, s, l;
+        rgb2hsl(pix[0], pix[1], pix[2], &h, &s, &l);
+        p_Data.hsl[i * 4 + 0] = h;
+        p_Data.hsl[i * 4 + 1] = s;
+        p_Data.hsl[i * 4 + 2] = l;
+        p_Data.hsl[i * 4 + 3] = 0.0f;
+
+        // The 8 bit frames are the same picture with a bit of noise, like neighbouring frames would be
+        for (int f = 0; f < 3; f++) {
+            RGBA8& pix8 = p_Data.frames[f][i];
+            float value[3];
+            for (int c = 0; c < 3; c++) {
+                value[c] = 255.0f * pix[c] + 8.0f * (random01() - 0.5f);
+                value[c] = value[c] < 0.0f ? 0.0f : (value[c] > 255.0f ? 255.0f : value[c]);
+            }
+            pix8.r = static_cast<unsigned char>(value[0]);
+            pix8.g = static_cast<unsigned char>(value[1]);
+            pix8.b = static_cast<unsigned char>(value[2]);
+            pix8.a = 255;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Kernels
+
+static void benchRgb2hslScalar(BenchData& p_Data)
+{
+    const float* src = p_Data.rgba.data();
+    float* dst = p_Data.out.data();
+    for (size_t i = 0; i < p_Data.count; i++) {
+        float h, s, l;
+        rgb2hsl(src[0], src[1], src[2], &h, &s, &l);
+        dst[0] = h;
+        dst[1] = s;
+        dst[2] = l;
+        src += 4;
+        dst += 4;
+    }
+}
+
+static void benchHslMatteScalar(BenchData& p_Data)
+{
+    // The hue/saturation/luminance window and multiplier code on its own
+    const float* hsl = p_Data.hsl.data();
+    float* dst = p_Data.out.data();
+    for (size_t i = 0; i < p_Data.count; i++) {
+        dst[3] = hslMatte(p_Data.params, hsl[0], hsl[1], hsl[2]);
+        hsl += 4;
+        dst += 4;
+    }
+}
+
+static void benchQualifyScalar(BenchData& p_Data)
+{
+    // What QualiFlower does per pixel, bar the mask and smoothing
+    const float* src = p_Data.rgba.data();
+    float* dst = p_Data.out.data();
+    for (size_t i = 0; i < p_Data.count; i++) {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+        dst[3] = qualify(p_Data.params, src[0], src[1], src[2]);
+        src += 4;
+        dst += 4;
+    }
+}
+
+static void benchAverageRowScalar(BenchData& p_Data)
+{
+    averageRow(p_Data.frames[0].data(), p_Data.frames[1].data(), p_Data.frames[2].data(),
+               p_Data.out8.data(), static_cast<int>(p_Data.count));
+}
+
+static void benchAccumulateScalar(BenchData& p_Data)
+{
+    // A frame of TemporalAverage's recursive mode: blend the new frame in, and write it out
+    const int count = static_cast<int>(p_Data.count);
+    blendAccumulatorRow(p_Data.frames[1].data(), p_Data.accumulator.data(), count, 0.5f);
+    accumulatorRow(p_Data.accumulator.data(), p_Data.out8.data(), count);
+}
+
+// The signature and processWindow kernels treat the buffers as an image kSignatureImageWidth wide
+#define kSignatureImageWidth 1920
+
+static Rect benchWindow(const BenchData& p_Data)
+{
+    const int width = p_Data.count < kSignatureImageWidth ? static_cast<int>(p_Data.count) : kSignatureImageWidth;
+    Rect window = { 0, 0, width, static_cast<int>(p_Data.count / width) };
+    return window;
+}
+
+template <bool MASKED>
+static void benchProcessWindow(BenchData& p_Data)
+{
+    // The whole of the library's per pixel path on one thread, float rgba in and out, with or
+    // without a mask. Pixels the mask hides are skipped, so the masked time depends on its area
+    const Rect window = benchWindow(p_Data);
+    const ptrdiff_t rowBytes = static_cast<ptrdiff_t>(window.x2) * 4 * sizeof(float);
+    FrameJob job;
+    job.params.qualifier = p_Data.params;
+    job.src = Frame(p_Data.rgba.data(), window.x2, window.y2, rowBytes, eFormatRGBAFloat);
+    job.dst = Frame(p_Data.out.data(), window.x2, window.y2, rowBytes, eFormatRGBAFloat);
+    if (MASKED) {
+        job.mask = Frame(p_Data.mask.data(), window.x2, window.y2, window.x2 * sizeof(float), eFormatAlphaFloat);
+        job.occupancy = &p_Data.occupancy;
+    }
+    job.window = window;
+    processWindow(job, window);
+}
+
+template <void (*ROWLUMA)(const unsigned char*, int, uint32_t*)>
+static void benchSignature(BenchData& p_Data)
+{
+    // Only every kSignatureColumnStep'th pixel of every kSignatureRowStep'th row gets read, but the
+    // time is per pixel of the whole frame
+    FrameSignature signature;
+    const Rect window = benchWindow(p_Data);
+    computeSignature<ROWLUMA>(reinterpret_cast<const unsigned char*>(p_Data.frames[1].data()),
+                              window.x2, window.y2, window.x2 * 4, p_Data.lumaRow.data(), &signature);
+    p_Data.out[0] = signature.blockMeans[0];
+}
+
+template <void (*ROW)(const float*, int, float*, uint32_t*)>
+static void benchWhitePoint(BenchData& p_Data)
+{
+    // The max and histogram of a whole frame, as the percentile white point needs
+    memset(p_Data.whitePointBins.data(), 0, kWhitePointBins * sizeof(uint32_t));
+    float max = 0.0f;
+    ROW(p_Data.rgba.data(), static_cast<int>(p_Data.count), &max, p_Data.whitePointBins.data());
+    p_Data.out[p_Data.count * 2] = whitePointFromHistogram(p_Data.whitePointBins.data(), max, 99.0);
+}
+
+/** @brief A kernel, and which of its implementations this is */
+struct Kernel
+{
+    const char* name;
+    const char* variant;
+    void (*run)(BenchData& p_Data);
+};
+
+static const Kernel kKernels[] = {
+    { "rgb2hsl", "scalar", benchRgb2hslScalar },
+    { "hslMatte", "scalar", benchHslMatteScalar },
+    { "qualify", "scalar", benchQualifyScalar },
+    { "averageRow", "scalar", benchAverageRowScalar },
+    { "accumulate", "scalar", benchAccumulateScalar },
+    { "signature", "scalar", benchSignature<rowLumaScalar> },
+#ifdef __SSE2__
+    { "signature", "sse2", benchSignature<rowLumaSSE2> },
+#endif
+    { "whitePoint", "scalar", benchWhitePoint<whitePointRowScalar> },
+#ifdef QUALIFLOWER_SSE2
+    { "whitePoint", "sse2", benchWhitePoint<whitePointRowSSE2> },
+#endif
+    { "processWindow", "unmasked", benchProcessWindow<false> },
+    { "processWindow", "masked", benchProcessWindow<true> },
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char** argv)
+{
+    const size_t count = argc > 1 ? strtoul(argv[1], 0, 10) : 1920 * 1080;
+    const int repeats = argc > 2 ? atoi(argv[2]) : 5;
+    if (count == 0 || repeats <= 0) {
+        fprintf(stderr, "Usage: %s [pixels] [repeats]\n", argv[0]);
+        return 1;
+    }
+
+    BenchData data;
+    data.count = count;
+    data.rgba.resize(count * 4);
+    data.hsl.resize(count * 4);
+    data.out.resize(count * 4);
+    for (int f = 0; f < 3; f++) data.frames[f].resize(count);
+    data.out8.resize(count);
+    data.accumulator.resize(count * 3);
+    data.lumaRow.resize(kSignatureImageWidth);
+    data.whitePointBins.resize(kWhitePointBins);
+
+    // A garbage mask leaving an ellipse in the middle of the frame visible, about 40% of it
+    const Rect window = benchWindow(data);
+    data.mask.resize(count);
+    for (int y = 0; y < window.y2; y++) {
+        for (int x = 0; x < window.x2; x++) {
+            const float dx = (x + 0.5f) / window.x2 - 0.5f;
+            const float dy = (y + 0.5f) / window.y2 - 0.5f;
+            data.mask[static_cast<size_t>(y) * window.x2 + x] = dx * dx + dy * dy < 0.125f ? 1.0f : 0.0f;
+        }
+    }
+    computeMaskOccupancy(Frame(data.mask.data(), window.x2, window.y2, window.x2 * sizeof(float), eFormatAlphaFloat),
+                         window, data.occupancy);
+
+    // A typical selection, with everything enabled and soft edges
+    QualifierParams& params = data.params;
+    params.hueEnabled = true;
+    params.hue = 30;
+    params.hueWidth = 20;
+    params.hueSoftness = 10;
+    params.saturationEnabled = true;
+    params.saturationLow = 20;
+    params.saturationHigh = 80;
+    params.saturationLowSoftness = 10;
+    params.saturationHighSoftness = 10;
+    params.luminanceEnabled = true;
+    params.luminanceLow = 10;
+    params.luminanceHigh = 90;
+    params.luminanceLowSoftness = 10;
+    params.luminanceHighSoftness = 10;
+    params.luminanceScale = 1;
+
+    PerfCounters counters;
+    printf("%zu pixels, best of %d runs", count, repeats);
+    if (!counters.available()) printf(" (perf_event_open not available, timing only)");
+    printf("\n\n");
+    printf("%-13s %-10s %-11s %9s %10s %6s %13s %13s\n",
+           "kernel", "variant", "input", "ns/px", "cycles/px", "IPC", "cache-ref/px", "cache-miss/px");
+
+    for (int d = 0; d < eNumDistributions; d++) {
+        fillPixels(data, static_cast<Distribution>(d));
+
+        for (size_t k = 0; k < sizeof(kKernels) / sizeof(kKernels[0]); k++) {
+            const Kernel& kernel = kKernels[k];
+            kernel.run(data); // warm up
+
+            double bestSeconds = 0.0;
+            uint64_t best[PerfCounters::eNumCounters] = { 0 };
+            for (int r = 0; r < repeats; r++) {
+                counters.start();
+                std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+                kernel.run(data);
+                std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+                counters.stop();
+
+                const double seconds = std::chrono::duration<double>(t1 - t0).count();
+                if (r == 0 || seconds < bestSeconds) {
+                    bestSeconds = seconds;
+                    for (int c = 0; c < PerfCounters::eNumCounters; c++) {
+                        best[c] = counters.value(static_cast<PerfCounters::Counter>(c));
+                    }
+                }
+            }
+            g_Sink = data.out[count * 2] + data.out8[count / 2].r;
+
+            printf("%-13s %-10s %-11s %9.3f", kernel.name, kernel.variant, kDistributionNames[d], 1e9 * bestSeconds / count);
+            if (counters.available(PerfCounters::eCycles) && best[PerfCounters::eCycles]) {
+                printf(" %10.2f", double(best[PerfCounters::eCycles]) / count);
+            } else {
+                printf(" %10s", "-");
+            }
+            if (counters.available(PerfCounters::eInstructions) && best[PerfCounters::eCycles]) {
+                printf(" %6.2f", double(best[PerfCounters::eInstructions]) / best[PerfCounters::eCycles]);
+            } else {
+                printf(" %6s", "-");
+            }
+            if (counters.available(PerfCounters::eCacheReferences)) {
+                printf(" %13.4f", double(best[PerfCounters::eCacheReferences]) / count);
+            } else {
+                printf(" %13s", "-");
+            }
+            if (counters.available(PerfCounters::eCacheMisses)) {
+                printf(" %13.4f", double(best[PerfCounters::eCacheMisses]) / count);
+            } else {
+                printf(" %13s", "-");
+            }
+            printf("\n");
+        }
+    }
+
+    return 0;
+}
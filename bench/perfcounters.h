@@ -0,0 +1,109 @@
+#pragma once
+
+// Hardware performance counters for the calling thread, via perf_event_open.
+// If the kernel won't give us them (not Linux, perf_event_paranoid, running in
+// a VM or container...) available() is false and callers should fall back to
+// just timing things.
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+class PerfCounters
+{
+public:
+    enum Counter { eCycles, eInstructions, eCacheReferences, eCacheMisses, eNumCounters };
+
+    PerfCounters();
+    ~PerfCounters();
+
+    /* Whether the cycle counter could be opened. The others might still be missing */
+    bool available() const { return _fds[eCycles] >= 0; }
+    bool available(Counter p_Counter) const { return _fds[p_Counter] >= 0; }
+
+    void start();
+    void stop();
+    /* The count between the last start() and stop() */
+    uint64_t value(Counter p_Counter) const { return _values[p_Counter]; }
+
+private:
+    int _fds[eNumCounters];
+    uint64_t _values[eNumCounters];
+};
+
+#ifdef __linux__
+
+inline PerfCounters::PerfCounters()
+{
+    static const uint64_t configs[eNumCounters] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_REFERENCES,
+        PERF_COUNT_HW_CACHE_MISSES,
+    };
+
+    for (int i = 0; i < eNumCounters; i++) {
+        _values[i] = 0;
+
+        // The cycle counter leads the group, so they're all scheduled on and off the PMU together
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.disabled = i == eCycles ? 1 : 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        const int leader = i == eCycles ? -1 : _fds[eCycles];
+        _fds[i] = (i == eCycles || leader >= 0)
+            ? static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0))
+            : -1;
+    }
+}
+
+inline PerfCounters::~PerfCounters()
+{
+    for (int i = 0; i < eNumCounters; i++) {
+        if (_fds[i] >= 0) close(_fds[i]);
+    }
+}
+
+inline void PerfCounters::start()
+{
+    if (!available()) return;
+    ioctl(_fds[eCycles], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(_fds[eCycles], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+inline void PerfCounters::stop()
+{
+    if (!available()) return;
+    ioctl(_fds[eCycles], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    for (int i = 0; i < eNumCounters; i++) {
+        uint64_t value = 0;
+        if (_fds[i] < 0 || read(_fds[i], &value, sizeof(value)) != sizeof(value)) value = 0;
+        _values[i] = value;
+    }
+}
+
+#else
+
+inline PerfCounters::PerfCounters()
+{
+    for (int i = 0; i < eNumCounters; i++) {
+        _fds[i] = -1;
+        _values[i] = 0;
+    }
+}
+
+inline PerfCounters::~PerfCounters() {}
+inline void PerfCounters::start() {}
+inline void PerfCounters::stop() {}
+
+#endif